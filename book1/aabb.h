@@ -0,0 +1,83 @@
+#ifndef AABB_H
+#define AABB_H
+
+// axis-aligned bounding box, one interval per axis
+// if a ray misses the box it misses everything inside it, so we can skip whole groups of objects with one test
+class aabb
+{
+public:
+    interval x, y, z;
+
+    aabb() {} // empty by default, intervals start out empty
+
+    aabb(const interval &x, const interval &y, const interval &z) : x(x), y(y), z(z) {}
+
+    // a and b are opposite corners, in any order
+    aabb(const point3 &a, const point3 &b)
+    {
+        x = (a[0] <= b[0]) ? interval(a[0], b[0]) : interval(b[0], a[0]);
+        y = (a[1] <= b[1]) ? interval(a[1], b[1]) : interval(b[1], a[1]);
+        z = (a[2] <= b[2]) ? interval(a[2], b[2]) : interval(b[2], a[2]);
+    }
+
+    // box around two boxes
+    aabb(const aabb &box0, const aabb &box1)
+    {
+        x = interval(box0.x, box1.x);
+        y = interval(box0.y, box1.y);
+        z = interval(box0.z, box1.z);
+    }
+
+    const interval &axis_interval(int n) const
+    {
+        if (n == 1)
+            return y;
+        if (n == 2)
+            return z;
+        return x;
+    }
+
+    // slab test: clip ray_t by the range of t where the ray is inside each axis' slab
+    // if the range is still non-empty after all three axes the ray passes through the box
+    bool hit(const ray &r, interval ray_t) const
+    {
+        return clip(r, ray_t);
+    }
+
+    // the same test, but ray_t is left as the part of the ray inside the box, ray_t.min is where the ray enters it
+    bool clip(const ray &r, interval &ray_t) const
+    {
+        const point3 &ray_orig = r.origin();
+        const vec3 &ray_dir = r.direction();
+
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const interval &ax = axis_interval(axis);
+            const double adinv = 1.0 / ray_dir[axis];
+
+            auto t0 = (ax.min - ray_orig[axis]) * adinv;
+            auto t1 = (ax.max - ray_orig[axis]) * adinv;
+
+            if (t0 < t1)
+            {
+                if (t0 > ray_t.min)
+                    ray_t.min = t0;
+                if (t1 < ray_t.max)
+                    ray_t.max = t1;
+            }
+            else
+            {
+                if (t1 > ray_t.min)
+                    ray_t.min = t1;
+                if (t0 < ray_t.max)
+                    ray_t.max = t0;
+            }
+
+            if (ray_t.max <= ray_t.min)
+                return false;
+        }
+        return true;
+    }
+};
+
+#endif
@@ -1,8 +1,23 @@
 #ifndef CAMERA_H
 #define CAMERA_H
 
+#include "clustered_scene.h"
+#include "framebuffer.h"
 #include "hittable.h"
+#include "hittable_list.h"
 #include "material.h"
+#include "numa.h"
+#include "parallel.h"
+#include "postprocess.h"
+#include "render_scene.h"
+#include "sphere_list.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <vector>
 
 class camera
 {
@@ -17,34 +32,88 @@ public:
     point3 lookat = point3(0, 0, -1);  // point camera is looking at
     vec3 vup = vec3(0, 1, 0);          // camera-relative "up" direction
 
+    double defocus_angle = 0; // variation angle of rays through each pixel (the aperture), 0 = pinhole, everything sharp
+    double focus_dist = 0;    // distance from lookfrom to the plane of perfect focus, 0 = focus on lookat
+    int tile_size = 16;       // the image is rendered in square tiles this many pixels wide
+
+    postprocess_settings post; // denoiser, exposure and tone mapping applied to the finished image
+
+    unsigned int seed = 1;           // every tile reseeds from this, so the same settings give the same image on any thread count
+    bool show_progress = true;       // print tiles remaining to stderr
+    bool specialized_kernels = true; // pick a render kernel compiled for this scene's features, false always runs the generic one
+    bool numa_aware = false;         // pin render threads to cores, give each numa node its own scene copy and framebuffer pages
+    int batch_rays = 1 << 16;        // out-of-core scenes trace about this many rays together, at least a tile per thread
+
     void render(const hittable &world)
     {
-        initialize();
+        render_scene scene(world, numa_aware);
+        render(scene);
+    }
+
+    // scenes that get rendered more than once should be prepared once and passed in like this
+    void render(const render_scene &scene)
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        framebuffer fb;
+        render_frame(scene, fb);
 
         std::cout << "P3\n"
                   << image_width << ' ' << image_height << "\n255\n";
+        for (const auto &pixel_color : fb.pixels)
+            write_color(std::cout, pixel_color);
 
-        for (int j = 0; j < image_height; j++) // for every pixel in height
-        {
-            // going left-right-up-down, every pixel in height is a scanline
-            std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::endl;
-            for (int i = 0; i < image_width; i++) // for every pixel in width
-            {
-                color pixel_color(0, 0, 0); // initialized to black
+        // wall time of the whole render, so speedups and slowdowns show up next to the image
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::clog << "\rDone in " << elapsed.count() << " s.\t";
+    }
 
-                // multiple samples for the pixel
-                for (int sample = 0; sample < samples_per_pixel; sample++)
-                {
-                    // ray for this sample
-                    ray r = get_ray(i, j);
-                    // the color the ray sees to our running sum
-                    pixel_color += ray_color(r, max_depth, world);
-                }
-                // average all samples by multiplying by 1/samples_per_pixel
-                write_color(std::cout, pixel_samples_scale * pixel_color);
-            }
+    // render and post process into fb without writing it anywhere, tiles are spread across all cores
+    // if cancel gets set while we're rendering, tiles that haven't finished give up and we return false
+    bool render_frame(const hittable &world, framebuffer &fb, const std::atomic<bool> *cancel = nullptr)
+    {
+        render_scene scene(world, numa_aware);
+        return render_frame(scene, fb, cancel);
+    }
+
+    bool render_frame(const render_scene &scene, framebuffer &fb, const std::atomic<bool> *cancel = nullptr)
+    {
+        initialize();
+        fb = framebuffer(image_width, image_height, numa_aware);
+
+        // the scene already knows which kernel it can run, a scene made only of spheres gets the sphere kernel
+        const sphere_list *spheres = specialized_kernels ? scene.sphere_world() : nullptr;
+        // without a denoiser nothing reads the AOVs, so the kernel doesn't write them
+        bool aovs = !specialized_kernels || post.denoise_passes > 0;
+
+        if (auto clustered = scene.clustered_world())
+        {
+            if (aovs)
+                render_waves<true>(scene, *clustered, fb, cancel);
+            else
+                render_waves<false>(scene, *clustered, fb, cancel);
+        }
+        else if (spheres)
+        {
+            if (aovs)
+                render_tiles_for_depth<sphere_list, true>(scene, *spheres, fb, cancel);
+            else
+                render_tiles_for_depth<sphere_list, false>(scene, *spheres, fb, cancel);
         }
-        std::clog << "\rDone.\t";
+        else
+        {
+            if (aovs)
+                render_tiles_for_depth<hittable, true>(scene, scene.world, fb, cancel);
+            else
+                render_tiles_for_depth<hittable, false>(scene, scene.world, fb, cancel);
+        }
+
+        if (cancel && *cancel)
+            return false;
+
+        // the whole image is in memory now, so filters can look at neighboring pixels
+        post_process(fb, post);
+        return true;
     }
 
 private:
@@ -55,6 +124,8 @@ private:
     vec3 pixel_delta_u;         // offset of pixel to the right
     vec3 pixel_delta_v;         // offset of pixel below
     vec3 u, v, w;               // camera frame basis vectors
+    vec3 defocus_disk_u;        // defocus disk horizontal radius
+    vec3 defocus_disk_v;        // defocus disk vertical radius
     void initialize()
     {
         image_height = int(image_width / aspect_ratio);
@@ -66,7 +137,8 @@ private:
 
         // viewport dimensions
 
-        auto focal_length = (lookfrom - lookat).length();
+        // the viewport sits on the focus plane, so the point a ray aims at is always in focus
+        auto focal_length = focus_dist > 0 ? focus_dist : (lookfrom - lookat).length();
         auto theta = degrees_to_radians(vfov);
         auto h = std::tan(theta / 2);
         auto viewport_height = 2 * h * focal_length;
@@ -97,22 +169,334 @@ private:
         auto viewport_upper_left = center - (focal_length * w) - viewport_u / 2 - viewport_v / 2;
         // start at viewport upper left corner, move inward by half a pixel in both directions, center of first pixel
         pixel00_loc = viewport_upper_left + 0.5 * (pixel_delta_u + pixel_delta_v);
+
+        // the lens: a disk around the camera center whose radius makes the defocus_angle cone reach the focus plane
+        auto defocus_radius = focal_length * std::tan(degrees_to_radians(defocus_angle / 2));
+        defocus_disk_u = u * defocus_radius;
+        defocus_disk_v = v * defocus_radius;
+    }
+
+    // render kernels are compiled for a fixed set of scene features:
+    //   World     - sphere_list for sphere-only scenes (no virtual hit calls), hittable for anything
+    //   MaxDepth  - bounce limit known at compile time so the bounce loop has a constant trip count, 0 = use max_depth
+    //   Aovs      - whether albedo/normal/depth get written for the denoiser
+    // the common depths get their own kernel, anything else goes through the runtime depth one
+    template <typename World, bool Aovs>
+    void render_tiles_for_depth(const render_scene &scene, const World &world, framebuffer &fb, const std::atomic<bool> *cancel) const
+    {
+        if (!specialized_kernels)
+            return render_tiles<World, 0, Aovs>(scene, world, fb, cancel);
+
+        switch (max_depth)
+        {
+        case 10:
+            return render_tiles<World, 10, Aovs>(scene, world, fb, cancel);
+        case 20:
+            return render_tiles<World, 20, Aovs>(scene, world, fb, cancel);
+        case 50:
+            return render_tiles<World, 50, Aovs>(scene, world, fb, cancel);
+        default:
+            return render_tiles<World, 0, Aovs>(scene, world, fb, cancel);
+        }
+    }
+
+    template <typename World, int MaxDepth, bool Aovs>
+    void render_tiles(const render_scene &scene, const World &world, framebuffer &fb, const std::atomic<bool> *cancel) const
+    {
+        int tiles_x = (image_width + tile_size - 1) / tile_size;
+        int tiles_y = (image_height + tile_size - 1) / tile_size;
+        int tile_count = tiles_x * tiles_y;
+        std::atomic<int> tiles_done(0);
+        std::mutex progress_lock;
+
+        auto tile_work = [&](int tile, const World &local_world)
+        {
+            if (cancel && *cancel)
+                return;
+
+            int tx = (tile % tiles_x) * tile_size;
+            int ty = (tile / tiles_x) * tile_size;
+            // tiles on the right and bottom edges can be cut short
+            int x1 = std::min(tx + tile_size, image_width);
+            int y1 = std::min(ty + tile_size, image_height);
+
+            // the framebuffer left these pages untouched, writing them here puts them on this thread's node
+            if (numa_aware)
+                fb.clear_tile(tx, ty, x1, y1);
+
+            seed_random(seed + tile);
+            render_tile<MaxDepth, Aovs>(local_world, fb, tx, ty, x1, y1, cancel);
+
+            int done = ++tiles_done;
+            if (show_progress)
+            {
+                std::lock_guard<std::mutex> guard(progress_lock);
+                std::clog << "\rTiles remaining: " << (tile_count - done) << ' ' << std::endl;
+            }
+        };
+
+        if (!numa_aware)
+        {
+            parallel_for_dynamic(tile_count, [&](int tile)
+                                 { tile_work(tile, world); });
+            return;
+        }
+
+        // every thread reads the scene copy on its own node, the scene made those copies when it was loaded
+        const numa_topology &topology = scene.numa_nodes();
+        parallel_for_pinned(tile_count, topology, [&](int tile, int node)
+                            { tile_work(tile, on_node(scene, world, node)); });
+    }
+
+    // only sphere scenes get a copy per node, anything else is shared by every node
+    template <typename World>
+    static const World &on_node(const render_scene &, const World &world, int) { return world; }
+
+    static const sphere_list &on_node(const render_scene &scene, const sphere_list &, int node)
+    {
+        return scene.sphere_world_on(node);
+    }
+
+    // trace every pixel of the tile [x0, x1) x [y0, y1) into fb, only this thread touches those pixels
+    template <int MaxDepth, bool Aovs, typename World>
+    void render_tile(const World &world, framebuffer &fb, int x0, int y0, int x1, int y1, const std::atomic<bool> *cancel) const
+    {
+        // all rays for the tile first, then trace them in the same order
+        std::vector<ray_differential> batch;
+        generate_tile_rays(x0, y0, x1, y1, batch);
+        size_t next = 0;
+
+        for (int j = y0; j < y1; j++)
+        {
+            // checked once per pixel row so a cancel takes effect within a fraction of a tile
+            if (cancel && *cancel)
+                return;
+
+            for (int i = x0; i < x1; i++)
+            {
+                color pixel_color(0, 0, 0); // initialized to black
+
+                // multiple samples for the pixel
+                for (int sample = 0; sample < samples_per_pixel; sample++, next++)
+                    // the color the ray sees to our running sum
+                    pixel_color += ray_color<World, MaxDepth>(batch[next], world);
+
+                // average all samples by multiplying by 1/samples_per_pixel
+                fb.pixels[fb.index(i, j)] = pixel_samples_scale * pixel_color;
+
+                // albedo, normal and depth through the pixel center for the denoiser
+                if (Aovs)
+                    write_aovs(fb, i, j, world);
+            }
+        }
+    }
+
+    // out-of-core scenes are traced a wave of tiles at a time, bounce by bounce for all of the wave's rays at once
+    // each bounce hands every ray still alive to hit_batch, which pages each cluster in once for all the rays that
+    // need it and spreads the clusters across the cores, so the more tiles in a wave the fewer page ins per ray
+    // every tile keeps its own random generator between bounces, so the image is the same however tiles are grouped
+    template <bool Aovs>
+    void render_waves(const render_scene &scene, const clustered_scene &world, framebuffer &fb, const std::atomic<bool> *cancel) const
+    {
+        int tiles_x = (image_width + tile_size - 1) / tile_size;
+        int tiles_y = (image_height + tile_size - 1) / tile_size;
+        int tile_count = tiles_x * tiles_y;
+        int wave_size = std::max(thread_count(), batch_rays / (tile_size * tile_size * samples_per_pixel));
+
+        struct tile_state
+        {
+            int x0, y0, x1, y1;
+            std::mt19937 generator;
+            std::vector<ray_differential> batch;
+            std::vector<ray> rays;
+            std::vector<color> throughput;
+            std::vector<color> ray_colors; // stays black for rays that run out of bounces
+            std::vector<size_t> alive;     // indices of rays that are still bouncing
+        };
+
+        // the per tile steps run on all cores, pinned like the other kernels when the framebuffer is placed per node
+        auto for_each_tile = [&](int count, const std::function<void(int)> &f)
+        {
+            if (numa_aware)
+                parallel_for_pinned(count, scene.numa_nodes(), [&](int t, int)
+                                    { f(t); });
+            else
+                parallel_for_dynamic(count, f);
+        };
+
+        std::vector<ray> rays;
+        std::vector<hit_record> recs;
+        std::vector<char> hits;
+        int tiles_done = 0;
+
+        for (int first = 0; first < tile_count; first += wave_size)
+        {
+            if (cancel && *cancel)
+                return;
+
+            std::vector<tile_state> tiles(std::min(wave_size, tile_count - first));
+            for_each_tile(int(tiles.size()), [&](int t)
+                          {
+                              tile_state &tile = tiles[t];
+                              int tile_index = first + t;
+                              tile.x0 = (tile_index % tiles_x) * tile_size;
+                              tile.y0 = (tile_index / tiles_x) * tile_size;
+                              tile.x1 = std::min(tile.x0 + tile_size, image_width);
+                              tile.y1 = std::min(tile.y0 + tile_size, image_height);
+                              if (numa_aware)
+                                  fb.clear_tile(tile.x0, tile.y0, tile.x1, tile.y1);
+
+                              seed_random(seed + tile_index);
+                              generate_tile_rays(tile.x0, tile.y0, tile.x1, tile.y1, tile.batch);
+                              tile.generator = random_generator();
+
+                              tile.rays.assign(tile.batch.begin(), tile.batch.end());
+                              tile.throughput.assign(tile.batch.size(), color(1, 1, 1));
+                              tile.ray_colors.assign(tile.batch.size(), color(0, 0, 0));
+                              tile.alive.resize(tile.batch.size());
+                              for (size_t i = 0; i < tile.alive.size(); i++)
+                                  tile.alive[i] = i;
+                          });
+
+            // where each tile's rays start in the wave's batch
+            std::vector<size_t> offsets(tiles.size() + 1);
+            for (int depth = 0; depth < max_depth; depth++)
+            {
+                if (cancel && *cancel)
+                    return;
+
+                rays.clear();
+                for (size_t t = 0; t < tiles.size(); t++)
+                {
+                    offsets[t] = rays.size();
+                    for (auto i : tiles[t].alive)
+                        rays.push_back(tiles[t].rays[i]);
+                }
+                offsets[tiles.size()] = rays.size();
+                if (rays.empty())
+                    break;
+                world.hit_batch(rays, interval(0.001, infinity), recs, hits);
+
+                for_each_tile(int(tiles.size()), [&](int t)
+                              {
+                                  tile_state &tile = tiles[t];
+                                  random_generator() = tile.generator;
+
+                                  size_t kept = 0;
+                                  for (size_t k = 0; k < tile.alive.size(); k++)
+                                  {
+                                      size_t i = tile.alive[k];
+                                      size_t b = offsets[t] + k;
+                                      if (!hits[b])
+                                      {
+                                          tile.ray_colors[i] = tile.throughput[i] * sky_color(tile.rays[i]);
+                                          continue;
+                                      }
+
+                                      hit_record &rec = recs[b];
+                                      if (depth == 0)
+                                          rec.footprint = tile.batch[i].footprint(rec.p, rec.normal);
+
+                                      ray scattered;
+                                      color attenuation;
+                                      if (!rec.mat->scatter(tile.rays[i], rec, attenuation, scattered))
+                                          continue; // absorbed, stays black
+
+                                      tile.throughput[i] = tile.throughput[i] * attenuation;
+                                      tile.rays[i] = scattered;
+                                      tile.alive[kept++] = i;
+                                  }
+                                  tile.alive.resize(kept);
+                                  tile.generator = random_generator();
+                              });
+            }
+
+            // rays are in pixel order, samples_per_pixel of them per pixel
+            for_each_tile(int(tiles.size()), [&](int t)
+                          {
+                              const tile_state &tile = tiles[t];
+                              size_t next = 0;
+                              for (int j = tile.y0; j < tile.y1; j++)
+                                  for (int i = tile.x0; i < tile.x1; i++)
+                                  {
+                                      color pixel_color(0, 0, 0);
+                                      for (int sample = 0; sample < samples_per_pixel; sample++, next++)
+                                          pixel_color += tile.ray_colors[next];
+                                      fb.pixels[fb.index(i, j)] = pixel_samples_scale * pixel_color;
+
+                                      if (Aovs)
+                                          write_aovs(fb, i, j, world);
+                                  }
+                          });
+
+            tiles_done += int(tiles.size());
+            if (show_progress)
+                std::clog << "\rTiles remaining: " << (tile_count - tiles_done) << ' ' << std::endl;
+        }
     }
 
-    // make a camera ray originating from the origin and directed at a sampled point around the pixel i,j
-    ray get_ray(int i, int j) const
+    // every camera ray for the pixels [x0, x1) x [y0, y1), samples_per_pixel per pixel in row order
+    // instead of rebuilding each pixel's position from pixel00_loc we step from one pixel center to the next
+    void generate_tile_rays(int x0, int y0, int x1, int y1, std::vector<ray_differential> &batch) const
     {
-        // random offset within the pixel
-        auto offset = sample_square();
+        batch.clear();
+        batch.reserve(size_t(x1 - x0) * (y1 - y0) * samples_per_pixel);
 
-        // exact point to shoot rays through, starts at top left pixel, move right by i + random offset, move down by j + random offset
-        auto pixel_sample = pixel00_loc + ((i + offset.x()) * pixel_delta_u) + ((j + offset.y()) * pixel_delta_v);
-        // ray starts at camera center
-        auto ray_origin = center;
-        // ray points from camera to sampled point
-        auto ray_direction = pixel_sample - ray_origin;
+        auto row_start = pixel00_loc + (x0 * pixel_delta_u) + (y0 * pixel_delta_v);
+        for (int j = y0; j < y1; j++, row_start += pixel_delta_v)
+        {
+            auto pixel_center = row_start;
+            for (int i = x0; i < x1; i++, pixel_center += pixel_delta_u)
+            {
+                for (int sample = 0; sample < samples_per_pixel; sample++)
+                {
+                    // random offset within the pixel
+                    auto offset = sample_square();
+                    auto pixel_sample = pixel_center + (offset.x() * pixel_delta_u) + (offset.y() * pixel_delta_v);
+
+                    // ray starts at the camera center, or somewhere on the lens if we have depth of field
+                    auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample();
+                    auto ray_direction = pixel_sample - ray_origin;
+
+                    // neighbors leave from the same lens point and aim one pixel over
+                    batch.emplace_back(ray_origin, ray_direction,
+                                       ray_origin, ray_direction + pixel_delta_u,
+                                       ray_origin, ray_direction + pixel_delta_v);
+                }
+            }
+        }
+    }
+
+    // random point on the camera lens
+    point3 defocus_disk_sample() const
+    {
+        auto p = random_in_unit_disk();
+        return center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
+    }
+
+    // first hit of the ray through the exact pixel center, no random numbers used so the image stays the same
+    template <typename World>
+    void write_aovs(framebuffer &fb, int i, int j, const World &world) const
+    {
+        auto pixel_center = pixel00_loc + (i * pixel_delta_u) + (j * pixel_delta_v);
+        ray r(center, pixel_center - center);
+        hit_record rec;
+        int p = fb.index(i, j);
 
-        return ray(ray_origin, ray_direction);
+        if (world.hit(r, interval(0.001, infinity), rec))
+        {
+            fb.albedo[p] = rec.mat->aov_albedo(rec);
+            fb.normal[p] = rec.normal;
+            // t is in units of the direction length, scale it so depth is a real distance
+            fb.depth[p] = rec.t * r.direction().length();
+        }
+        else
+        {
+            // the sky, we give it its background color so it doesn't blend with geometry
+            fb.albedo[p] = sky_color(r);
+            fb.normal[p] = vec3(0, 0, 0);
+            fb.depth[p] = infinity;
+        }
     }
 
     vec3 sample_square() const
@@ -121,28 +505,45 @@ private:
         return vec3(random_double() - 0.5, random_double() - 0.5, 0);
     }
 
-    color ray_color(const ray &r, int depth, const hittable &world) const
+    // follows a camera ray as it bounces around the scene, as a loop instead of recursion
+    // throughput is the product of every attenuation so far, what's left of the light that reaches the camera
+    template <typename World, int MaxDepth>
+    color ray_color(const ray_differential &camera_ray, const World &world) const
     {
-        // if we exceed ray bounces, no more light is gathered
-        if (depth <= 0)
-            return color(0, 0, 0);
-        hit_record rec;
+        const int depth_limit = MaxDepth > 0 ? MaxDepth : max_depth;
+        color throughput(1, 1, 1);
+        ray r = camera_ray;
 
-        // ignoring hits close to the calculated intersection point
-        // this fixes "shadow acne" problem (dark spots or stripes on lit surfaces)
-        if (world.hit(r, interval(0.001, infinity), rec))
+        // if we exceed ray bounces, no more light is gathered
+        for (int depth = 0; depth < depth_limit; depth++)
         {
+            hit_record rec;
+
+            // ignoring hits close to the calculated intersection point
+            // this fixes "shadow acne" problem (dark spots or stripes on lit surfaces)
+            if (!world.hit(r, interval(0.001, infinity), rec))
+                return throughput * sky_color(r);
+
+            // only the camera ray knows its pixel footprint, bounced rays leave it at 0
+            if (depth == 0)
+                rec.footprint = camera_ray.footprint(rec.p, rec.normal);
+
             ray scattered;     // new direction after scattering
             color attenuation; // how much the ray's color is reduced by material
             // we use arrow notation bc mat is a pointer
-            if (rec.mat->scatter(r, rec, attenuation, scattered))
-                // if ray has been scattered by material
-                // calculate recursively by calling ray color on scattered ray
-                // depth - 1 to limit recursion
-                return attenuation * ray_color(scattered, depth - 1, world);
-            return color(0, 0, 0); // if no scattering return 0
+            if (!rec.mat->scatter(r, rec, attenuation, scattered))
+                return color(0, 0, 0); // if no scattering return 0
+
+            // keep going along the scattered ray with less light left
+            throughput = throughput * attenuation;
+            r = scattered;
         }
 
+        return color(0, 0, 0);
+    }
+
+    color sky_color(const ray &r) const
+    {
         vec3 unit_direction = unit_vector(r.direction()); // normalize ray direction
         // take direction of the ray and make it a unit vector (length of 1), just keeping the direction info
 
@@ -0,0 +1,604 @@
+#ifndef CLUSTERED_SCENE_H
+#define CLUSTERED_SCENE_H
+
+#include "aabb.h"
+#include "hittable.h"
+#include "material.h"
+#include "parallel.h"
+#include "sphere.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// out-of-core geometry: spheres live in a memory-mapped file instead of RAM
+// the file is cut into clusters of nearby spheres (sorted along a morton curve), each cluster in its own page-aligned block
+// only a tree over the cluster boxes stays in memory, the sphere data gets paged in by the OS when a ray needs it
+// and we drop clusters again once more than the residency budget is paged in, so the scene can be far bigger than RAM
+// the file has everything needed to render it, so it can be written once and opened again later
+//
+// file layout:
+//   header, padded to a page
+//   cluster blocks, one page each: the packed spheres, then one material index per sphere
+//   cluster table, one entry per cluster: box, byte offset and sphere count
+//   material table, one packed_material per distinct material
+
+struct cluster_file_header
+{
+    char magic[4]; // "RTCL"
+    std::uint32_t cluster_size;
+    std::uint64_t sphere_count;
+    std::uint64_t cluster_count;
+    std::uint64_t block_size;     // bytes per cluster block, the page size of the machine that wrote the file
+    std::uint64_t table_offset;   // where the cluster table starts, right after the last block
+    std::uint64_t material_count; // the material table follows the cluster table
+};
+
+struct cluster_entry
+{
+    double bounds[6]; // box min xyz, max xyz
+    std::uint64_t offset;
+    std::uint32_t count;
+    std::uint32_t padding;
+};
+
+// a sphere on disk, materials are stored separately as indices into the file's material table
+struct packed_sphere
+{
+    double center[3];
+    double radius;
+};
+
+// spread the low 21 bits of v out so there are two zero bits between each, for interleaving three axes
+inline std::uint64_t spread_bits(std::uint64_t v)
+{
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffull;
+    v = (v | v << 16) & 0x1f0000ff0000ffull;
+    v = (v | v << 8) & 0x100f00f00f00f00full;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+    v = (v | v << 2) & 0x1249249249249249ull;
+    return v;
+}
+
+// writes a cluster file from spheres handed over one at a time, so the scene never has to fit in memory
+// spheres are buffered into chunks, every chunk is sorted along a morton curve and cut into clusters on its own
+// only one chunk, the cluster table and the materials are in RAM at any time
+// clusters come out compact as long as spheres that arrive close together are close in space too,
+// which holds for the generators in scenes.h, arbitrary input would need an external sort across chunks
+class cluster_file_writer
+{
+public:
+    // a cluster is as many spheres as fit in one page (113 with 4 KiB pages), so a block is exactly a page,
+    // paging one in reads nothing but its own spheres and the file is hardly any padding
+    // chunk_size is how many spheres get sorted together, rounded up to whole clusters
+    explicit cluster_file_writer(const std::string &path, size_t chunk_size = size_t(1) << 20)
+        : out(path, std::ios::binary), page(std::uint64_t(sysconf(_SC_PAGESIZE)))
+    {
+        cluster_size = std::uint32_t(page / (sizeof(packed_sphere) + sizeof(std::uint32_t)));
+        block_size = page;
+        data_offset = (sizeof(cluster_file_header) + page - 1) / page * page;
+        this->chunk_size = (chunk_size + cluster_size - 1) / cluster_size * cluster_size;
+
+        // the real header goes in once we know the counts
+        std::vector<char> blank(data_offset, 0);
+        out.write(blank.data(), blank.size());
+        pending.reserve(this->chunk_size);
+    }
+
+    void add(const sphere &s)
+    {
+        pending.push_back(s);
+        if (pending.size() >= chunk_size)
+            flush_chunk();
+    }
+
+    // writes what's left, the tables and the header, false if anything went wrong along the way
+    bool finish()
+    {
+        flush_chunk();
+        if (clusters.empty())
+            return false;
+
+        cluster_file_header header = {{'R', 'T', 'C', 'L'}, cluster_size, sphere_total, clusters.size(), block_size,
+                                      data_offset + clusters.size() * block_size, packed_materials.size()};
+        out.write(reinterpret_cast<const char *>(clusters.data()), clusters.size() * sizeof(cluster_entry));
+        out.write(reinterpret_cast<const char *>(packed_materials.data()), packed_materials.size() * sizeof(packed_material));
+        out.seekp(0);
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.flush();
+        return !failed && bool(out);
+    }
+
+    // false once the file couldn't be created or a write to it failed
+    bool valid() const { return bool(out); }
+    std::uint64_t sphere_count() const { return sphere_total; }
+
+private:
+    std::ofstream out;
+    std::uint64_t page;
+    std::uint32_t cluster_size;
+    size_t chunk_size;
+    std::uint64_t block_size;
+    std::uint64_t data_offset; // where the blocks start
+    std::uint64_t sphere_total = 0;
+    bool failed = false;
+
+    std::vector<sphere> pending;
+    std::vector<cluster_entry> clusters;
+
+    // materials become small indices, we hold on to them so a freed material's address can't be reused by another
+    std::vector<packed_material> packed_materials;
+    std::vector<shared_ptr<material>> seen_materials;
+    std::unordered_map<const material *, std::uint32_t> material_index;
+
+    std::uint32_t index_of(const shared_ptr<material> &mat)
+    {
+        auto found = material_index.find(mat.get());
+        if (found != material_index.end())
+            return found->second;
+
+        packed_material packed;
+        if (!mat || !mat->pack(packed))
+        {
+            // image textured materials can't go in the file
+            failed = true;
+            packed = packed_material();
+        }
+        std::uint32_t index = std::uint32_t(packed_materials.size());
+        material_index.emplace(mat.get(), index);
+        packed_materials.push_back(packed);
+        seen_materials.push_back(mat);
+        return index;
+    }
+
+    void flush_chunk()
+    {
+        if (pending.empty())
+            return;
+
+        // morton order: quantize every center into the chunk's box and interleave the bits of x, y and z
+        // spheres next to each other on the curve are next to each other in space, so clusters come out compact
+        aabb bounds;
+        for (const auto &s : pending)
+            bounds = aabb(bounds, aabb(s.get_center(), s.get_center()));
+
+        std::vector<std::pair<std::uint64_t, std::uint32_t>> order(pending.size());
+        for (size_t i = 0; i < pending.size(); i++)
+        {
+            std::uint64_t code = 0;
+            for (int axis = 0; axis < 3; axis++)
+            {
+                const interval &ax = bounds.axis_interval(axis);
+                double t = ax.size() > 0 ? (pending[i].get_center()[axis] - ax.min) / ax.size() : 0;
+                code |= spread_bits(std::uint64_t(t * 2097151.0)) << axis;
+            }
+            order[i] = std::make_pair(code, std::uint32_t(i));
+        }
+        std::sort(order.begin(), order.end());
+
+        std::vector<char> block(block_size);
+        for (size_t first = 0; first < pending.size(); first += cluster_size)
+        {
+            size_t last = std::min(pending.size(), first + cluster_size);
+            std::fill(block.begin(), block.end(), 0);
+            auto packed = reinterpret_cast<packed_sphere *>(block.data());
+            auto mats = reinterpret_cast<std::uint32_t *>(block.data() + cluster_size * sizeof(packed_sphere));
+
+            aabb box;
+            for (size_t i = first; i < last; i++)
+            {
+                const sphere &s = pending[order[i].second];
+                packed_sphere &p = packed[i - first];
+                p.center[0] = s.get_center().x();
+                p.center[1] = s.get_center().y();
+                p.center[2] = s.get_center().z();
+                p.radius = s.get_radius();
+                mats[i - first] = index_of(s.get_material());
+                box = aabb(box, s.bounding_box());
+            }
+
+            cluster_entry entry = {};
+            entry.bounds[0] = box.x.min;
+            entry.bounds[1] = box.y.min;
+            entry.bounds[2] = box.z.min;
+            entry.bounds[3] = box.x.max;
+            entry.bounds[4] = box.y.max;
+            entry.bounds[5] = box.z.max;
+            entry.offset = data_offset + clusters.size() * block_size;
+            entry.count = std::uint32_t(last - first);
+            clusters.push_back(entry);
+
+            // blocks go out in cluster order, so the file position is always entry.offset here
+            out.write(block.data(), block.size());
+        }
+
+        sphere_total += pending.size();
+        pending.clear();
+    }
+};
+
+class clustered_scene : public hittable
+{
+public:
+    // budget_bytes is how much sphere data we let stay paged in at once
+    clustered_scene(const std::string &path, size_t budget_bytes) : budget_bytes(budget_bytes)
+    {
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat info;
+        if (::fstat(fd, &info) < 0 || size_t(info.st_size) < sizeof(cluster_file_header))
+            return;
+
+        // read only and backed by the file, so dropping pages is always safe, the OS just reads them again
+        mapped_size = size_t(info.st_size);
+        void *mapped = ::mmap(nullptr, mapped_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED)
+            return;
+        base = static_cast<const char *>(mapped);
+
+        cluster_file_header header;
+        std::memcpy(&header, base, sizeof(header));
+        std::uint64_t tables_end = header.table_offset + header.cluster_count * sizeof(cluster_entry) +
+                                   header.material_count * sizeof(packed_material);
+        // a file that was never finished has an all zero header
+        if (std::memcmp(header.magic, "RTCL", 4) != 0 || tables_end > mapped_size)
+            return;
+        cluster_size = header.cluster_size;
+        block_size = header.block_size;
+
+        // the material table is tiny, the scene gets its own material objects from it
+        auto packed = reinterpret_cast<const packed_material *>(base + header.table_offset + header.cluster_count * sizeof(cluster_entry));
+        for (std::uint64_t m = 0; m < header.material_count; m++)
+        {
+            materials.push_back(unpack_material(packed[m]));
+            if (!materials.back())
+                return;
+        }
+
+        // the cluster table is copied into RAM, it's small next to the spheres (one entry per cluster_size spheres)
+        auto table = reinterpret_cast<const cluster_entry *>(base + header.table_offset);
+        clusters.assign(table, table + header.cluster_count);
+        referenced = std::vector<std::atomic<bool>>(clusters.size());
+        resident = std::vector<std::atomic<bool>>(clusters.size());
+
+        // boxes for the tree, and for the distance to each cluster a ray crosses in hit_batch
+        for (const auto &c : clusters)
+            boxes.push_back(aabb(point3(c.bounds[0], c.bounds[1], c.bounds[2]), point3(c.bounds[3], c.bounds[4], c.bounds[5])));
+        if (!clusters.empty())
+        {
+            std::vector<int> order(clusters.size());
+            for (size_t c = 0; c < order.size(); c++)
+                order[c] = int(c);
+            build_tree(order, 0, int(order.size()));
+        }
+    }
+
+    ~clustered_scene()
+    {
+        if (base)
+            ::munmap(const_cast<char *>(base), mapped_size);
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+    clustered_scene(const clustered_scene &) = delete;
+    clustered_scene &operator=(const clustered_scene &) = delete;
+
+    bool valid() const { return !nodes.empty(); }
+    size_t cluster_count() const { return clusters.size(); }
+    // box around the whole scene
+    aabb bounds() const { return nodes.empty() ? aabb() : nodes[0].box; }
+
+    // how many times a cluster had to be paged in, compare with rays traced to see how well batching amortizes it
+    size_t cluster_loads() const { return loads; }
+
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+    {
+        bool hit_anything = false;
+        for_each_cluster(r, ray_t, [&](int c)
+                         {
+                             if (hit_cluster(c, r, ray_t, rec))
+                             {
+                                 hit_anything = true;
+                                 ray_t.max = rec.t;
+                             }
+                             // the tree walk sees the shrinking range, so it skips clusters behind the hit
+                             return ray_t.max;
+                         });
+        return hit_anything;
+    }
+
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        bool blocked = false;
+        for_each_cluster(r, ray_t, [&](int c)
+                         {
+                             blocked = blocked || occluded_cluster(c, r, ray_t);
+                             // an empty range stops the walk
+                             return blocked ? ray_t.min : ray_t.max;
+                         });
+        return blocked;
+    }
+
+    // closest hits for a whole batch of rays at once, cluster by cluster instead of ray by ray
+    // every ray first lists the clusters its path crosses, nearest box first. then we go in rounds: each ray still
+    // looking waits at the nearest cluster it hasn't tried, every cluster with rays waiting is paged in once for all
+    // of them, and a ray drops out as soon as its hit is closer than the next box it would enter
+    // so like a front to back walk a ray never pages in clusters behind its first hit, and one page fault is paid
+    // for by every ray that reaches the cluster in that round. the clusters of a round are spread across all cores,
+    // the bigger the batch the more rays share each page in
+    void hit_batch(const std::vector<ray> &rays, interval ray_t, std::vector<hit_record> &recs, std::vector<char> &hits) const
+    {
+        recs.assign(rays.size(), hit_record());
+        hits.assign(rays.size(), 0);
+
+        // (distance to the box, cluster) for every cluster each ray passes through, sorted by distance
+        std::vector<std::vector<std::pair<double, int>>> crossings(rays.size());
+        const int group = 256;
+        parallel_for_dynamic(int((rays.size() + group - 1) / group), [&](int g)
+                             {
+                                 size_t last = std::min(rays.size(), size_t(g + 1) * group);
+                                 for (size_t i = size_t(g) * group; i < last; i++)
+                                 {
+                                     for_each_cluster(rays[i], ray_t, [&](int c)
+                                                      {
+                                                          interval inside = ray_t;
+                                                          boxes[c].clip(rays[i], inside);
+                                                          crossings[i].emplace_back(inside.min, c);
+                                                          return ray_t.max;
+                                                      });
+                                     std::sort(crossings[i].begin(), crossings[i].end());
+                                 }
+                             });
+
+        // how far down its crossings list each ray is, and the rays that still have clusters to try
+        std::vector<std::uint32_t> next(rays.size(), 0);
+        std::vector<std::uint32_t> looking;
+        for (size_t i = 0; i < rays.size(); i++)
+            if (!crossings[i].empty())
+                looking.push_back(std::uint32_t(i));
+
+        // (cluster, ray) for this round, sorted so each cluster's rays end up together
+        std::vector<std::pair<std::uint32_t, std::uint32_t>> waiting;
+        std::vector<size_t> runs;
+        while (!looking.empty())
+        {
+            waiting.clear();
+            for (auto i : looking)
+                waiting.emplace_back(std::uint32_t(crossings[i][next[i]].second), i);
+            std::sort(waiting.begin(), waiting.end());
+
+            runs.clear();
+            for (size_t w = 0; w < waiting.size(); w++)
+                if (w == 0 || waiting[w].first != waiting[w - 1].first)
+                    runs.push_back(w);
+            runs.push_back(waiting.size());
+
+            // every ray waits at exactly one cluster, so no two threads touch the same ray
+            parallel_for_dynamic(int(runs.size() - 1), [&](int run)
+                                 {
+                                     for (size_t w = runs[run]; w < runs[run + 1]; w++)
+                                     {
+                                         int c = int(waiting[w].first);
+                                         std::uint32_t i = waiting[w].second;
+                                         interval range(ray_t.min, hits[i] ? recs[i].t : ray_t.max);
+                                         if (hit_cluster(c, rays[i], range, recs[i]))
+                                             hits[i] = 1;
+                                         next[i]++;
+                                     }
+                                 });
+
+            // a hit inside a box can't be closer than where the ray enters it, so once the hit is in front of
+            // the next box nothing further along can beat it
+            size_t kept = 0;
+            for (auto i : looking)
+            {
+                double closest = hits[i] ? recs[i].t : ray_t.max;
+                if (next[i] < crossings[i].size() && crossings[i][next[i]].first < closest)
+                    looking[kept++] = i;
+            }
+            looking.resize(kept);
+        }
+    }
+
+private:
+    // tree over the clusters, built from their morton order by halving the range, kept in RAM
+    struct node
+    {
+        aabb box;
+        int left = -1; // child nodes, -1 for a leaf
+        int right = -1;
+        int cluster = -1; // the leaf's cluster
+    };
+
+    std::vector<shared_ptr<material>> materials;
+    int fd = -1;
+    const char *base = nullptr;
+    size_t mapped_size = 0;
+    std::uint32_t cluster_size = 0;
+    std::uint64_t block_size = 0;
+
+    std::vector<cluster_entry> clusters;
+    std::vector<aabb> boxes;
+    std::vector<node> nodes;
+
+    // residency tracking, a CLOCK approximation of LRU
+    // touching a resident cluster only sets its referenced bit, no lock, so hits stay cheap
+    // paging a new cluster in takes the lock and sweeps the clock hand over resident clusters,
+    // giving referenced ones a second chance and dropping the first one that wasn't touched since the last sweep
+    size_t budget_bytes;
+    mutable std::vector<std::atomic<bool>> referenced;
+    mutable std::vector<std::atomic<bool>> resident;
+    mutable std::mutex residency_lock;
+    mutable std::vector<int> clock_ring;
+    mutable size_t clock_hand = 0;
+    mutable size_t resident_bytes = 0;
+    mutable std::atomic<size_t> loads{0};
+
+    // splits order[first, last) at the median cluster center along the widest axis
+    // the file is only morton sorted within each chunk, so the tree can't just halve the file order
+    int build_tree(std::vector<int> &order, int first, int last)
+    {
+        int index = int(nodes.size());
+        nodes.push_back(node());
+        if (last - first == 1)
+        {
+            nodes[index].box = boxes[order[first]];
+            nodes[index].cluster = order[first];
+            return index;
+        }
+
+        aabb centers;
+        for (int i = first; i < last; i++)
+        {
+            const aabb &b = boxes[order[i]];
+            point3 center(b.x.min + b.x.max, b.y.min + b.y.max, b.z.min + b.z.max);
+            centers = aabb(centers, aabb(center, center));
+        }
+        int axis = 0;
+        for (int a = 1; a < 3; a++)
+            if (centers.axis_interval(a).size() > centers.axis_interval(axis).size())
+                axis = a;
+
+        int mid = first + (last - first) / 2;
+        std::nth_element(order.begin() + first, order.begin() + mid, order.begin() + last, [&](int a, int b)
+                         { return boxes[a].axis_interval(axis).min + boxes[a].axis_interval(axis).max <
+                                  boxes[b].axis_interval(axis).min + boxes[b].axis_interval(axis).max; });
+
+        int left = build_tree(order, first, mid);
+        int right = build_tree(order, mid, last);
+        nodes[index].left = left;
+        nodes[index].right = right;
+        nodes[index].box = aabb(nodes[left].box, nodes[right].box);
+        return index;
+    }
+
+    // calls visit(cluster) for every cluster whose box the ray passes through within ray_t
+    // visit returns the new end of the range, so callers can narrow it as they find hits
+    template <typename F>
+    void for_each_cluster(const ray &r, interval ray_t, F visit) const
+    {
+        if (nodes.empty())
+            return;
+
+        int stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0)
+        {
+            const node &n = nodes[stack[--top]];
+            if (!n.box.hit(r, ray_t))
+                continue;
+            if (n.cluster >= 0)
+            {
+                ray_t.max = visit(n.cluster);
+                if (ray_t.max <= ray_t.min)
+                    return;
+                continue;
+            }
+            stack[top++] = n.left;
+            stack[top++] = n.right;
+        }
+    }
+
+    const packed_sphere *cluster_spheres(int c) const
+    {
+        touch(c);
+        return reinterpret_cast<const packed_sphere *>(base + clusters[c].offset);
+    }
+
+    const std::uint32_t *cluster_materials(int c) const
+    {
+        return reinterpret_cast<const std::uint32_t *>(base + clusters[c].offset + cluster_size * sizeof(packed_sphere));
+    }
+
+    bool hit_cluster(int c, const ray &r, interval ray_t, hit_record &rec) const
+    {
+        const packed_sphere *spheres = cluster_spheres(c);
+        int closest_index = -1;
+        double root;
+
+        // find the closest root first and fill the hit record once, like sphere_list but without sphere objects
+        for (std::uint32_t i = 0; i < clusters[c].count; i++)
+        {
+            point3 center(spheres[i].center[0], spheres[i].center[1], spheres[i].center[2]);
+            if (sphere::nearest_root(center, spheres[i].radius, r, ray_t, root))
+            {
+                ray_t.max = root;
+                closest_index = int(i);
+            }
+        }
+        if (closest_index < 0)
+            return false;
+
+        const packed_sphere &s = spheres[closest_index];
+        sphere::set_hit_record(point3(s.center[0], s.center[1], s.center[2]), s.radius,
+                               materials[cluster_materials(c)[closest_index]], r, ray_t.max, rec);
+        return true;
+    }
+
+    bool occluded_cluster(int c, const ray &r, interval ray_t) const
+    {
+        const packed_sphere *spheres = cluster_spheres(c);
+        double root;
+        for (std::uint32_t i = 0; i < clusters[c].count; i++)
+        {
+            point3 center(spheres[i].center[0], spheres[i].center[1], spheres[i].center[2]);
+            if (sphere::nearest_root(center, spheres[i].radius, r, ray_t, root))
+                return true;
+        }
+        return false;
+    }
+
+    // mark a cluster as used, and if it isn't paged in yet account for it and make room under the budget
+    void touch(int c) const
+    {
+        referenced[c].store(true, std::memory_order_relaxed);
+        if (resident[c].load(std::memory_order_acquire))
+            return;
+
+        std::lock_guard<std::mutex> guard(residency_lock);
+        if (resident[c].load(std::memory_order_relaxed))
+            return; // another thread got here first
+
+        resident[c].store(true, std::memory_order_release);
+        clock_ring.push_back(c);
+        resident_bytes += block_size;
+        loads++;
+
+        // always keep the cluster we're about to read
+        while (resident_bytes > budget_bytes && clock_ring.size() > 1)
+        {
+            clock_hand %= clock_ring.size();
+            int candidate = clock_ring[clock_hand];
+            if (candidate == c || referenced[candidate].exchange(false, std::memory_order_relaxed))
+            {
+                clock_hand++;
+                continue;
+            }
+
+            // tell the OS we're done with these pages, if some thread still reads them they just get faulted back in
+            ::madvise(const_cast<char *>(base + clusters[candidate].offset), block_size, MADV_DONTNEED);
+            resident[candidate].store(false, std::memory_order_release);
+            resident_bytes -= block_size;
+            clock_ring[clock_hand] = clock_ring.back();
+            clock_ring.pop_back();
+        }
+    }
+};
+
+#endif
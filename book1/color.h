@@ -14,22 +14,20 @@ inline double linear_to_gamma(double linear_component)
     return 0;
 }
 
-void write_color(std::ostream &out, const color &pixel_color)
+// gamma correct one linear color component and translate it to the byte range [0, 255]
+inline int component_to_byte(double linear_component)
 {
-    auto r = pixel_color.x();
-    auto g = pixel_color.y();
-    auto b = pixel_color.z();
-
-    r = linear_to_gamma(r);
-    g = linear_to_gamma(g);
-    b = linear_to_gamma(b);
-
     static const interval intensity(0.000, 0.999);
-    // translating the [0, 1] component values to the byte range [0, 255]
-    int rbyte = int(256 * intensity.clamp(r));
-    // ppm and such want 8 bits of num values (up to 255) so we multiply by 256 and clamped r
-    int gbyte = int(256 * intensity.clamp(g));
-    int bbyte = int(256 * intensity.clamp(b));
+    // ppm and such want 8 bits of num values (up to 255) so we multiply by 256 and the clamped component
+    return int(256 * intensity.clamp(linear_to_gamma(linear_component)));
+}
+
+void write_color(std::ostream &out, const color &pixel_color)
+{
+    // translating the [0, 1] component values to the byte range [0, 255]
+    int rbyte = component_to_byte(pixel_color.x());
+    int gbyte = component_to_byte(pixel_color.y());
+    int bbyte = component_to_byte(pixel_color.z());
 
     // write out the color componnets
 
@@ -0,0 +1,95 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include <new>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+
+// gets image memory straight from the kernel and doesn't write to it when the vector is created
+// fresh pages read as zero and only get placed in memory when something first writes them,
+// so on a numa machine each page lands on the node of the thread that renders into it
+// elements start out as all zero bits, which is only right for plain data like color and double
+template <typename T>
+struct untouched_allocator
+{
+    using value_type = T;
+
+    untouched_allocator() {}
+    template <typename U>
+    untouched_allocator(const untouched_allocator<U> &) {}
+
+    T *allocate(size_t n)
+    {
+        if (n == 0)
+            return nullptr;
+        void *memory = ::mmap(nullptr, n * sizeof(T), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+            throw std::bad_alloc();
+        return static_cast<T *>(memory);
+    }
+
+    void deallocate(T *p, size_t n)
+    {
+        if (p)
+            ::munmap(p, n * sizeof(T));
+    }
+
+    // default construction would write zeros over every page from the allocating thread, the pages are zero already
+    template <typename U>
+    void construct(U *) {}
+    template <typename U, typename... Args>
+    void construct(U *p, Args &&...args) { ::new ((void *)p) U(std::forward<Args>(args)...); }
+};
+
+template <typename T, typename U>
+bool operator==(const untouched_allocator<T> &, const untouched_allocator<U> &) { return true; }
+template <typename T, typename U>
+bool operator!=(const untouched_allocator<T> &, const untouched_allocator<U> &) { return false; }
+
+template <typename T>
+using image_buffer = std::vector<T, untouched_allocator<T>>;
+
+// the whole image in linear float color, plus the AOVs (arbitrary output variables) the denoiser is guided by
+// we keep everything in memory so post processing can look at neighboring pixels before writing anything out
+class framebuffer
+{
+public:
+    int width = 0;
+    int height = 0;
+
+    image_buffer<color> pixels; // averaged radiance per pixel, linear (no gamma)
+    image_buffer<color> albedo; // surface color at the first hit
+    image_buffer<vec3> normal;  // unit surface normal at the first hit, zero if the ray hit the sky
+    image_buffer<double> depth; // distance along the camera ray to the first hit, infinity for the sky
+
+    framebuffer() {}
+    // with first_touch set nothing gets written here, whoever renders a tile has to clear_tile it first
+    framebuffer(int width, int height, bool first_touch = false)
+        : width(width), height(height),
+          pixels(width * height), albedo(width * height), normal(width * height), depth(width * height)
+    {
+        if (!first_touch)
+            clear_tile(0, 0, width, height);
+    }
+
+    // pixels are stored row by row, top row first
+    int index(int i, int j) const { return j * width + i; }
+
+    // black, no hit, for the pixels in [x0, x1) x [y0, y1)
+    void clear_tile(int x0, int y0, int x1, int y1)
+    {
+        for (int j = y0; j < y1; j++)
+            for (int i = x0; i < x1; i++)
+            {
+                int p = index(i, j);
+                pixels[p] = color(0, 0, 0);
+                albedo[p] = color(0, 0, 0);
+                normal[p] = vec3(0, 0, 0);
+                depth[p] = infinity;
+            }
+    }
+};
+
+#endif
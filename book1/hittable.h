@@ -11,6 +11,10 @@ public:
     vec3 normal;
     shared_ptr<material> mat;
     double t;
+    double u; // surface coordinates of the hit point, for texture lookups
+    double v;
+    double footprint = 0; // width of the pixel's footprint on the surface at p, 0 when unknown (bounced rays)
+    double uv_rate = 0;   // how fast u,v change per unit of distance along the surface, turns the footprint into uv units
     bool front_face;
 
     // hit record normal vector, takes in a ray and a unit length vec3
@@ -36,6 +40,15 @@ public:
     // ray r input, ray_t is part of the ray to check for hits, hit_record to fill with info if hit occurs
     virtual bool hit(const ray &r, interval ray_t, hit_record &rect) const = 0;
     // pure virtual function, no implementation in this class, functions that inherit must implement.
+
+    // any-hit query for visibility tests (shadow rays, ambient occlusion)
+    // we only want a yes or no, so we can stop at the first hit and skip building the hit record
+    // the default falls back to hit(), objects that can answer this cheaper should override it
+    virtual bool occluded(const ray &r, interval ray_t) const
+    {
+        hit_record rec;
+        return hit(r, ray_t, rec);
+    }
 };
 
 #endif
\ No newline at end of file
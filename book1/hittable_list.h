@@ -53,6 +53,19 @@ public:
 
         return hit_anything;
     }
+
+    // any object blocking the ray is enough, no need to find the closest one
+    // so we return on the first hit instead of walking the whole list
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        for (const auto &object : objects)
+        {
+            if (object->occluded(r, ray_t))
+                return true;
+        }
+
+        return false;
+    }
 };
 
 #endif
\ No newline at end of file
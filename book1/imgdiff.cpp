@@ -0,0 +1,62 @@
+#include "rtweekend.h"
+
+#include "ppm.h"
+
+#include <string>
+
+// compares two ppm images, e.g. a render after an optimization against one from before it
+// prints RMSE and PSNR in 8 bit units and fails (exit code 1) if they're worse than the limits
+// build with: g++ -std=c++14 -O2 imgdiff.cpp -o imgdiff
+// usage: ./imgdiff reference.ppm test.ppm [min_psnr_db] [max_rmse]
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        std::cerr << "usage: " << argv[0] << " reference.ppm test.ppm [min_psnr_db] [max_rmse]" << std::endl;
+        return 2;
+    }
+
+    // by default the images have to match exactly
+    double min_psnr = argc > 3 ? std::atof(argv[3]) : infinity;
+    double max_rmse = argc > 4 ? std::atof(argv[4]) : 0.0;
+    // if only a psnr limit is given, don't also demand a perfect rmse
+    if (argc == 4)
+        max_rmse = infinity;
+
+    ppm_image reference, test;
+    if (!reference.load(argv[1]))
+    {
+        std::cerr << "can't read " << argv[1] << std::endl;
+        return 2;
+    }
+    if (!test.load(argv[2]))
+    {
+        std::cerr << "can't read " << argv[2] << std::endl;
+        return 2;
+    }
+    if (reference.width != test.width || reference.height != test.height)
+    {
+        std::cerr << "size mismatch: " << reference.width << 'x' << reference.height
+                  << " vs " << test.width << 'x' << test.height << std::endl;
+        return 1;
+    }
+
+    // mean squared error over every color component, in 0-255 units so the numbers read like byte differences
+    double squared_error = 0;
+    for (size_t p = 0; p < reference.pixels.size(); p++)
+    {
+        vec3 diff = 255.0 * (reference.pixels[p] - test.pixels[p]);
+        squared_error += diff.length_squared();
+    }
+    double mse = squared_error / (3.0 * reference.pixels.size());
+    double rmse = std::sqrt(mse);
+    // identical images have zero error, psnr is infinite then
+    double psnr = mse > 0 ? 10.0 * std::log10(255.0 * 255.0 / mse) : infinity;
+
+    std::cout << "rmse: " << rmse << "  psnr: " << psnr << " dB" << std::endl;
+
+    bool pass = psnr >= min_psnr && rmse <= max_rmse;
+    std::cout << (pass ? "PASS" : "FAIL") << std::endl;
+    return pass ? 0 : 1;
+}
@@ -8,6 +8,13 @@ public:
     interval() : min(+infinity), max(-infinity) {}
     interval(double min, double max) : min(min), max(max) {}
 
+    // tightest interval holding both a and b
+    interval(const interval &a, const interval &b)
+    {
+        min = a.min <= b.min ? a.min : b.min;
+        max = a.max >= b.max ? a.max : b.max;
+    }
+
     double size() const
     {
         return max - min;
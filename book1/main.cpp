@@ -1,12 +1,70 @@
 #include "rtweekend.h"
 
 #include "camera.h"
+#include "clustered_scene.h"
 #include "hittable.h"
 #include "hittable_list.h"
 #include "material.h"
+#include "preview.h"
+#include "scenes.h"
 #include "sphere.h"
+#include "sphere_list.h"
+#include "texture.h"
+#include "texture_cache.h"
 
-int main()
+#include <chrono>
+#include <cstring>
+#include <string>
+
+// set by --preview, when it's not empty we serve frames to a viewer instead of writing one image to stdout
+std::string preview_socket;
+
+// set by --out-of-core, generated scenes get written to this cluster file and rendered from it instead of from RAM
+std::string out_of_core_path;
+// set by --clusters, an existing cluster file to render without generating anything
+std::string clusters_path;
+// set by --budget, megabytes of cluster data or texture tiles allowed to stay in memory
+size_t residency_budget_mb = 256;
+
+// set by --numa, pins render threads and keeps a copy of the scene on every numa node
+bool numa_aware = false;
+
+// set by --width, --samples and --seed, override what the scene picked (0 keeps it), so the regression test
+// can render every scene small and always the same way
+int width_override = 0;
+int samples_override = 0;
+unsigned int seed_override = 0;
+
+// every scene ends here once its world and camera are set up, false if the preview couldn't be served
+bool show(const hittable &world, camera &cam)
+{
+    cam.numa_aware = numa_aware;
+    if (width_override > 0)
+        cam.image_width = width_override;
+    if (samples_override > 0)
+        cam.samples_per_pixel = samples_override;
+    if (seed_override > 0)
+        cam.seed = seed_override;
+
+    // the kernel choice, any flattening of the scene and the per numa node copies happen once here, not on every frame
+    render_scene scene(world, numa_aware);
+
+    if (preview_socket.empty())
+    {
+        cam.render(scene);
+        return true;
+    }
+
+    preview_server server(scene, cam);
+    if (!server.serve(preview_socket))
+    {
+        std::cerr << "can't serve a preview on " << preview_socket << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool spheres()
 {
     hittable_list world;
 
@@ -27,28 +85,267 @@ int main()
     world.add(make_shared<sphere>(point3(-1.0, 0.0, -1.0), 0.4, material_bubble));
     world.add(make_shared<sphere>(point3(1.0, 0.0, -1.0), 0.5, material_right));
 
-    // touching spheres test
+    camera cam;
 
-    // auto R = std::cos(pi / 4);
-    // auto material_left = make_shared<lambertian>(color(0, 0, 1));
-    // auto material_right = make_shared<lambertian>(color(1, 0, 0));
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = 400;
+    // handling anti-aliasing through multiple samples per pixel
+    cam.samples_per_pixel = 100;
+    cam.max_depth = 20;
+    cam.vfov = 20; // field of view, lower number = more zoom-in
+    cam.lookfrom = point3(-2, 2, 1);
+    cam.lookat = point3(0, 0, -1);
+    cam.vup = vec3(0, 1, 0);
+
+    return show(world, cam);
+}
+
+bool touching_spheres()
+{
+    hittable_list world;
+
+    auto R = std::cos(pi / 4);
+    auto material_left = make_shared<lambertian>(color(0, 0, 1));
+    auto material_right = make_shared<lambertian>(color(1, 0, 0));
 
-    // world.add(make_shared<sphere>(point3(-R, 0, -1), R, material_left));
-    // world.add(make_shared<sphere>(point3(R, 0, -1), R, material_right));
+    world.add(make_shared<sphere>(point3(-R, 0, -1), R, material_left));
+    world.add(make_shared<sphere>(point3(R, 0, -1), R, material_right));
 
     camera cam;
 
     cam.aspect_ratio = 16.0 / 9.0;
     cam.image_width = 400;
-    // handling anti-aliasing through multiple samples per pixel
     cam.samples_per_pixel = 100;
     cam.max_depth = 20;
-    cam.vfov = 20; // field of view, lower number = more zoom-in
+    cam.vfov = 90;
+
+    return show(world, cam);
+}
+
+// the first scene again, but the center and the metal sphere are image textured through the texture cache
+// image_path is any ppm, without one we generate a checker pattern, either way it's converted to the tiled format first
+bool textured(const char *image_path)
+{
+    std::string source = image_path ? image_path : "/tmp/raytracer_checker.ppm";
+    if (!image_path && !checker_pattern(2048, 1024).save(source))
+    {
+        std::cerr << "can't write " << source << std::endl;
+        return false;
+    }
+    std::string tiled = source + ".rttx";
+    if (!write_tiled_texture(source, tiled))
+    {
+        std::cerr << "can't convert " << source << " to " << tiled << std::endl;
+        return false;
+    }
+
+    auto cache = make_shared<texture_cache>(residency_budget_mb * 1024 * 1024);
+    int handle = cache->open(tiled);
+    if (handle < 0)
+    {
+        std::cerr << "can't open " << tiled << std::endl;
+        return false;
+    }
+    auto image = make_shared<image_texture>(cache, handle);
+
+    hittable_list world;
+
+    world.add(make_shared<sphere>(point3(0.0, -100.5, -1.0), 100.0, make_shared<lambertian>(color(0.8, 0.8, 0.0))));
+    world.add(make_shared<sphere>(point3(0.0, 0.0, -1.2), 0.5, make_shared<lambertian>(image)));
+    world.add(make_shared<sphere>(point3(-1.0, 0.0, -1.0), 0.5, make_shared<dielectric>(1.50)));
+    world.add(make_shared<sphere>(point3(-1.0, 0.0, -1.0), 0.4, make_shared<dielectric>(1.00 / 1.50)));
+    world.add(make_shared<sphere>(point3(1.0, 0.0, -1.0), 0.5, make_shared<metal>(image, 0.3)));
+
+    camera cam;
+
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = 400;
+    cam.samples_per_pixel = 100;
+    cam.max_depth = 20;
+    cam.vfov = 20;
     cam.lookfrom = point3(-2, 2, 1);
     cam.lookat = point3(0, 0, -1);
     cam.vup = vec3(0, 1, 0);
 
-    cam.render(world);
+    bool shown = show(world, cam);
+    std::clog << std::endl
+              << cache->tile_loads() << " texture tiles loaded, " << cache->resident_bytes() / 1024 << " KiB resident" << std::endl;
+    return shown;
+}
+
+// camera placement for the procedural scenes
+void frame_generated(const char *name, size_t count, camera &cam)
+{
+    if (std::strcmp(name, "random") == 0)
+    {
+        // the book's camera, pulled back as the field grows
+        double scale = std::fmax(1.0, std::sqrt(double(count)) / 22.0);
+        cam.vfov = 20;
+        cam.lookfrom = scale * point3(13, 2, 3);
+        cam.lookat = point3(0, 0, 0);
+    }
+    else if (std::strcmp(name, "grid") == 0)
+    {
+        // looking at the cube from off a corner
+        double side = std::cbrt(double(count));
+        cam.vfov = 40;
+        cam.lookfrom = point3(1.2 * side, 0.8 * side, 1.6 * side);
+        cam.lookat = point3(0, 0, 0);
+    }
+    else
+    {
+        cam.vfov = 40;
+        cam.lookfrom = point3(0, 4, 16);
+        cam.lookat = point3(0, 0, 0);
+    }
+}
+
+// fills out with the named procedural scene, out is a sphere_list or a cluster_file_writer
+template <typename Output>
+void generate(const char *name, Output &out, size_t count)
+{
+    if (std::strcmp(name, "random") == 0)
+        random_sphere_field(out, count);
+    else if (std::strcmp(name, "grid") == 0)
+        sphere_grid(out, count);
+    else
+        fractal_cluster(out, count);
+}
+
+// render settings shared by the procedural scenes
+camera generated_camera()
+{
+    camera cam;
+
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = 400;
+    cam.samples_per_pixel = 10;
+    cam.max_depth = 20;
+    cam.vup = vec3(0, 1, 0);
+    return cam;
+}
+
+// render a cluster file straight from disk
+// name and count only place the camera like for the generated scene of that name, without a name we frame the whole scene
+bool clusters(const std::string &path, const char *name, size_t count)
+{
+    clustered_scene clustered(path, residency_budget_mb * 1024 * 1024);
+    if (!clustered.valid())
+    {
+        std::cerr << "can't open " << path << " as a cluster file" << std::endl;
+        return false;
+    }
+
+    camera cam = generated_camera();
+    if (name)
+        frame_generated(name, count, cam);
+    else
+    {
+        // from above and in front of the scene, far enough back that all of it fits
+        aabb box = clustered.bounds();
+        point3 center(0.5 * (box.x.min + box.x.max), 0.5 * (box.y.min + box.y.max), 0.5 * (box.z.min + box.z.max));
+        vec3 diagonal(box.x.size(), box.y.size(), box.z.size());
+        cam.vfov = 40;
+        cam.lookat = center;
+        cam.lookfrom = center + 1.5 * diagonal.length() * unit_vector(vec3(0, 0.25, 1));
+    }
+
+    bool shown = show(clustered, cam);
+    std::clog << std::endl
+              << clustered.cluster_count() << " clusters, paged in " << clustered.cluster_loads() << " times" << std::endl;
+    return shown;
+}
+
+// the procedural scenes, count is how many spheres to generate
+bool generated(const char *name, size_t count)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    if (!out_of_core_path.empty())
+    {
+        // streamed into the cluster file chunk by chunk, the whole scene is never in RAM
+        cluster_file_writer writer(out_of_core_path);
+        // a path we can't create fails here, before spending the time to generate the scene
+        if (writer.valid())
+            generate(name, writer, count);
+        if (!writer.valid() || !writer.finish())
+        {
+            std::cerr << "can't write " << out_of_core_path << std::endl;
+            return false;
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::clog << writer.sphere_count() << " spheres written to " << out_of_core_path << " in " << elapsed.count() << " s" << std::endl;
+
+        return clusters(out_of_core_path, name, count);
+    }
+
+    sphere_list world;
+    generate(name, world, count);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    // generation time and how much memory the sphere array takes, for the scaling numbers
+    std::clog << world.spheres.size() << " spheres generated in " << elapsed.count() << " s, "
+              << world.spheres.size() * sizeof(sphere) / (1024.0 * 1024.0) << " MiB" << std::endl;
+
+    camera cam = generated_camera();
+    frame_generated(name, count, cam);
+    return show(world, cam);
+}
+
+// usage: ./main [spheres | touching | random | grid | fractal] [sphere count] [--preview [socket path]]
+//               [--out-of-core cluster file] [--budget MB] [--numa] [--width pixels] [--samples per pixel] [--seed n]
+//        ./main textured [image.ppm]
+//        ./main [random | grid | fractal] [sphere count] --clusters cluster file
+//               renders a cluster file written earlier by --out-of-core, the scene name and count only place the camera
+int main(int argc, char *argv[])
+{
+    // pull the options out first so the positional arguments stay where they were
+    std::vector<const char *> args;
+    for (int a = 1; a < argc; a++)
+    {
+        if (std::strcmp(argv[a], "--preview") == 0)
+            preview_socket = (a + 1 < argc && argv[a + 1][0] != '-') ? argv[++a] : "/tmp/raytracer.sock";
+        else if (std::strcmp(argv[a], "--out-of-core") == 0 && a + 1 < argc)
+            out_of_core_path = argv[++a];
+        else if (std::strcmp(argv[a], "--clusters") == 0 && a + 1 < argc)
+            clusters_path = argv[++a];
+        else if (std::strcmp(argv[a], "--budget") == 0 && a + 1 < argc)
+            residency_budget_mb = std::strtoull(argv[++a], nullptr, 10);
+        else if (std::strcmp(argv[a], "--numa") == 0)
+            numa_aware = true;
+        else if (std::strcmp(argv[a], "--width") == 0 && a + 1 < argc)
+            width_override = std::atoi(argv[++a]);
+        else if (std::strcmp(argv[a], "--samples") == 0 && a + 1 < argc)
+            samples_override = std::atoi(argv[++a]);
+        else if (std::strcmp(argv[a], "--seed") == 0 && a + 1 < argc)
+            seed_override = unsigned(std::strtoul(argv[++a], nullptr, 10));
+        else
+            args.push_back(argv[a]);
+    }
+
+    const char *scene = args.size() > 0 ? args[0] : "spheres";
+    size_t count = args.size() > 1 ? std::strtoull(args[1], nullptr, 10) : 484;
+
+    bool is_generated = std::strcmp(scene, "random") == 0 || std::strcmp(scene, "grid") == 0 || std::strcmp(scene, "fractal") == 0;
+
+    bool ok;
+    if (!clusters_path.empty())
+        ok = clusters(clusters_path, is_generated ? scene : nullptr, count);
+    else if (std::strcmp(scene, "spheres") == 0)
+        ok = spheres();
+    else if (std::strcmp(scene, "touching") == 0)
+        ok = touching_spheres();
+    else if (std::strcmp(scene, "textured") == 0)
+        ok = textured(args.size() > 1 ? args[1] : nullptr);
+    else if (is_generated)
+        ok = generated(scene, count);
+    else
+    {
+        std::cerr << "unknown scene " << scene << ", pick one of: spheres touching textured random grid fractal" << std::endl;
+        return 1;
+    }
+    // a scene that couldn't be set up or served exits with an error, so scripts like tests/run.sh notice
+    return ok ? 0 : 1;
 }
 
-// continue from chapter 13
\ No newline at end of file
+// continue from chapter 13
@@ -2,6 +2,25 @@
 #define MATERIAL_H
 
 #include "hittable.h"
+#include "texture.h"
+
+#include <cstdint>
+
+// a material as plain data, how scenes stored in files (like out-of-core cluster files) keep their materials
+enum packed_material_type : std::uint32_t
+{
+    packed_lambertian = 1,
+    packed_metal = 2,
+    packed_dielectric = 3,
+};
+
+struct packed_material
+{
+    std::uint32_t type; // a packed_material_type
+    std::uint32_t padding;
+    double albedo[3];
+    double parameter; // fuzz for metal, refraction index for dielectric
+};
 
 class material
 {
@@ -12,6 +31,37 @@ public:
     {
         return false;
     }
+
+    // surface color at the hit for the albedo AOV, the denoiser uses it to tell materials apart
+    // white by default, which is also what clear materials attenuate by
+    virtual color aov_albedo(const hit_record &rec) const
+    {
+        return color(1, 1, 1);
+    }
+
+    // a separate copy of this material, for the per numa node scene copies
+    // textures stay shared, only the material object and its reference count are new
+    // every material has to say how it's copied, a default here would slice it into a plain material that never scatters
+    virtual shared_ptr<material> clone() const = 0;
+
+    // describe this material as plain data, false if it can't be (image textures live outside the file)
+    virtual bool pack(packed_material &out) const { return false; }
+
+protected:
+    // fills out for materials whose color is a texture, only single colors fit in a packed_material
+    static bool pack_solid(std::uint32_t type, const shared_ptr<texture> &tex, double parameter, packed_material &out)
+    {
+        auto solid = dynamic_cast<const solid_color *>(tex.get());
+        if (!solid)
+            return false;
+        out = packed_material();
+        out.type = type;
+        out.albedo[0] = solid->get_albedo().x();
+        out.albedo[1] = solid->get_albedo().y();
+        out.albedo[2] = solid->get_albedo().z();
+        out.parameter = parameter;
+        return true;
+    }
 };
 
 // we'll create albedo and have it always scatter instead of getting reabsorbed
@@ -19,7 +69,8 @@ public:
 class lambertian : public material
 {
 public:
-    lambertian(const color &albedo) : albedo(albedo) {}
+    lambertian(const color &albedo) : tex(make_shared<solid_color>(albedo)) {}
+    lambertian(shared_ptr<texture> tex) : tex(tex) {}
 
     bool scatter(const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered)
         const override
@@ -31,18 +82,25 @@ public:
             scatter_direction = rec.normal;
 
         scattered = ray(rec.p, scatter_direction);
-        attenuation = albedo;
+        attenuation = tex->filtered_value(rec.u, rec.v, rec.p, rec.footprint * rec.uv_rate);
         return true;
     }
 
+    color aov_albedo(const hit_record &rec) const override { return tex->value(rec.u, rec.v, rec.p); }
+
+    shared_ptr<material> clone() const override { return make_shared<lambertian>(*this); }
+
+    bool pack(packed_material &out) const override { return pack_solid(packed_lambertian, tex, 0, out); }
+
 private:
-    color albedo;
+    shared_ptr<texture> tex;
 };
 
 class metal : public material
 {
 public:
-    metal(const color &albedo, double fuzz) : albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) {}
+    metal(const color &albedo, double fuzz) : tex(make_shared<solid_color>(albedo)), fuzz(fuzz < 1 ? fuzz : 1) {}
+    metal(shared_ptr<texture> tex, double fuzz) : tex(tex), fuzz(fuzz < 1 ? fuzz : 1) {}
 
     bool scatter(const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered) const override
     {
@@ -53,13 +111,19 @@ public:
         // create a new ray that originates from the hit point in the direction of reflected
         scattered = ray(rec.p, reflected);
         // color reflection is the albedo
-        attenuation = albedo;
+        attenuation = tex->filtered_value(rec.u, rec.v, rec.p, rec.footprint * rec.uv_rate);
         // return true if the ray is scattered away from the surface, otherwise false (ray's absorbed)
         return (dot(scattered.direction(), rec.normal) > 0);
     }
 
+    color aov_albedo(const hit_record &rec) const override { return tex->value(rec.u, rec.v, rec.p); }
+
+    shared_ptr<material> clone() const override { return make_shared<metal>(*this); }
+
+    bool pack(packed_material &out) const override { return pack_solid(packed_metal, tex, fuzz, out); }
+
 private:
-    color albedo; // reflection
+    shared_ptr<texture> tex; // reflection color
     double fuzz;  // fuzziness factor, kinda like distortion
 };
 
@@ -98,6 +162,16 @@ public:
         return true;
     }
 
+    shared_ptr<material> clone() const override { return make_shared<dielectric>(*this); }
+
+    bool pack(packed_material &out) const override
+    {
+        out = packed_material();
+        out.type = packed_dielectric;
+        out.parameter = refraction_index;
+        return true;
+    }
+
 private:
     // refractive index in vacuum or air, or the ratio of the two media the ray goes through
     double refraction_index;
@@ -111,4 +185,21 @@ private:
     }
 };
 
+// the material a packed_material describes, nullptr for a type we don't know
+inline shared_ptr<material> unpack_material(const packed_material &packed)
+{
+    color albedo(packed.albedo[0], packed.albedo[1], packed.albedo[2]);
+    switch (packed.type)
+    {
+    case packed_lambertian:
+        return make_shared<lambertian>(albedo);
+    case packed_metal:
+        return make_shared<metal>(albedo, packed.parameter);
+    case packed_dielectric:
+        return make_shared<dielectric>(packed.parameter);
+    default:
+        return nullptr;
+    }
+}
+
 #endif
\ No newline at end of file
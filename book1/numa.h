@@ -0,0 +1,148 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include "parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// on a machine with several sockets every socket has its own memory (a numa node)
+// reading memory that belongs to the other socket goes over the interconnect and is noticeably slower
+// linux places a page on the node of the thread that first writes it, so to keep reads local we
+// pin render threads to cores and have a thread on each node build that node's own copy of the scene
+
+// which cpus belong to which node
+struct numa_topology
+{
+    std::vector<std::vector<int>> node_cpus;
+
+    int node_count() const { return int(node_cpus.size()); }
+};
+
+// parses the kernel's cpu list format, like "0-3,8-11"
+inline std::vector<int> parse_cpu_list(const std::string &list)
+{
+    std::vector<int> cpus;
+    std::istringstream in(list);
+    std::string range;
+    while (std::getline(in, range, ','))
+    {
+        int first, last;
+        char dash;
+        std::istringstream r(range);
+        if (!(r >> first))
+            continue;
+        if (r >> dash >> last)
+            for (int cpu = first; cpu <= last; cpu++)
+                cpus.push_back(cpu);
+        else
+            cpus.push_back(first);
+    }
+    return cpus;
+}
+
+// reads the nodes from sysfs, anywhere that doesn't have it looks like one node with every cpu on it
+inline numa_topology detect_numa_topology()
+{
+    numa_topology topology;
+
+#ifdef __linux__
+    for (int node = 0;; node++)
+    {
+        std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        std::string list;
+        if (!in || !std::getline(in, list))
+            break;
+        auto cpus = parse_cpu_list(list);
+        // memory-only nodes have no cpus to run on, nothing to pin there
+        if (!cpus.empty())
+            topology.node_cpus.push_back(cpus);
+    }
+#endif
+
+    if (topology.node_cpus.empty())
+    {
+        topology.node_cpus.emplace_back();
+        for (int cpu = 0; cpu < thread_count(); cpu++)
+            topology.node_cpus[0].push_back(cpu);
+    }
+    return topology;
+}
+
+// keep the calling thread on these cpus, does nothing where we can't set affinity (macos has no api for it)
+inline void pin_thread(const std::vector<int> &cpus)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus)
+        CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)cpus;
+#endif
+}
+
+// one copy per node from copy(), each made by a thread running on that node so the copy's pages are local to it
+template <typename T, typename Copy>
+std::vector<std::unique_ptr<T>> copy_per_node(const numa_topology &topology, Copy copy)
+{
+    std::vector<std::unique_ptr<T>> copies(topology.node_count());
+    std::vector<std::thread> builders;
+    for (int node = 0; node < topology.node_count(); node++)
+        builders.emplace_back([&, node]()
+                              {
+                                  pin_thread(topology.node_cpus[node]);
+                                  copies[node].reset(new T(copy()));
+                              });
+    for (auto &b : builders)
+        b.join();
+    return copies;
+}
+
+// like parallel_for_dynamic, but every worker is pinned to one core and f gets told which node it's on, as f(item, node)
+// cores are handed out alternating between nodes, so fewer threads than cores still use every socket
+template <typename F>
+void parallel_for_pinned(int count, const numa_topology &topology, F f)
+{
+    std::vector<std::pair<int, int>> cores; // (cpu, node)
+    for (size_t k = 0; cores.size() < size_t(thread_count()); k++)
+    {
+        bool any = false;
+        for (int node = 0; node < topology.node_count(); node++)
+            if (k < topology.node_cpus[node].size())
+            {
+                cores.emplace_back(topology.node_cpus[node][k], node);
+                any = true;
+            }
+        if (!any)
+            break;
+    }
+
+    std::atomic<int> next(0);
+    int n = std::min(std::min(int(cores.size()), thread_count()), count);
+    std::vector<std::thread> workers;
+    // the calling thread only waits here, pinning it would leave it pinned after we return
+    for (int t = 0; t < n; t++)
+        workers.emplace_back([&, t]()
+                             {
+                                 pin_thread({cores[t].first});
+                                 for (int item = next++; item < count; item = next++)
+                                     f(item, cores[t].second);
+                             });
+    for (auto &w : workers)
+        w.join();
+}
+
+#endif
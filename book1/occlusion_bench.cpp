@@ -0,0 +1,67 @@
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "sphere.h"
+
+#include <chrono>
+
+// compares the closest-hit query (hit) with the any-hit query (occluded) on a dense scene
+// build with: g++ -std=c++14 -O2 occlusion_bench.cpp -o occlusion_bench
+
+int main(int argc, char *argv[])
+{
+    // spheres per side of the grid, the scene has n*n*n spheres
+    int n = argc > 1 ? std::atoi(argv[1]) : 20;
+    int ray_count = argc > 2 ? std::atoi(argv[2]) : 20000;
+
+    seed_random(1);
+
+    hittable_list world;
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+
+    // a dense block of small spheres centered on the origin
+    for (int x = 0; x < n; x++)
+        for (int y = 0; y < n; y++)
+            for (int z = 0; z < n; z++)
+            {
+                point3 center(x - n / 2.0, y - n / 2.0, z - n / 2.0);
+                world.add(make_shared<sphere>(center, 0.3, mat));
+            }
+
+    // rays from random points inside the block in random directions, like shadow rays leaving a surface
+    std::vector<ray> rays;
+    for (int i = 0; i < ray_count; i++)
+        rays.push_back(ray(vec3::random(-n / 2.0, n / 2.0), random_unit_vector()));
+
+    interval ray_t(0.001, infinity);
+
+    auto start = std::chrono::steady_clock::now();
+    int hits = 0;
+    for (const auto &r : rays)
+    {
+        hit_record rec;
+        if (world.hit(r, ray_t, rec))
+            hits++;
+    }
+    auto mid = std::chrono::steady_clock::now();
+    int occlusions = 0;
+    for (const auto &r : rays)
+    {
+        if (world.occluded(r, ray_t))
+            occlusions++;
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    double hit_ms = std::chrono::duration<double, std::milli>(mid - start).count();
+    double occluded_ms = std::chrono::duration<double, std::milli>(end - mid).count();
+
+    std::cout << "spheres: " << world.objects.size() << ", rays: " << ray_count << std::endl;
+    std::cout << "hit:      " << hit_ms << " ms (" << hits << " hits)" << std::endl;
+    std::cout << "occluded: " << occluded_ms << " ms (" << occlusions << " occluded)" << std::endl;
+    std::cout << "speedup:  " << hit_ms / occluded_ms << "x" << std::endl;
+
+    // both queries have to agree on which rays are blocked
+    return hits == occlusions ? 0 : 1;
+}
@@ -0,0 +1,63 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// number of worker threads, at least 1 even if the runtime can't tell us the core count
+inline int thread_count()
+{
+    int n = int(std::thread::hardware_concurrency());
+    return n > 0 ? n : 1;
+}
+
+// run f(j) for every row j in [0, rows) spread across all cores
+// rows are interleaved (thread t takes t, t+n, t+2n...) so expensive regions of the image get shared out
+// f must only write to its own row, there's no locking here
+template <typename F>
+void parallel_for_rows(int rows, F f)
+{
+    int n = thread_count();
+    if (n == 1 || rows < 2)
+    {
+        for (int j = 0; j < rows; j++)
+            f(j);
+        return;
+    }
+
+    std::vector<std::thread> workers;
+    for (int t = 0; t < n; t++)
+        workers.emplace_back([=]()
+                             {
+                                 for (int j = t; j < rows; j += n)
+                                     f(j);
+                             });
+    for (auto &w : workers)
+        w.join();
+}
+
+// run f(item) for every item in [0, count), each thread grabs the next unclaimed item when it's done with one
+// good when items take very different amounts of time, like image tiles with and without geometry in them
+template <typename F>
+void parallel_for_dynamic(int count, F f)
+{
+    std::atomic<int> next(0);
+    auto work = [&]()
+    {
+        for (int item = next++; item < count; item = next++)
+            f(item);
+    };
+
+    int n = std::min(thread_count(), count);
+    std::vector<std::thread> workers;
+    for (int t = 1; t < n; t++)
+        workers.emplace_back(work);
+    // the calling thread works too instead of just waiting
+    work();
+    for (auto &w : workers)
+        w.join();
+}
+
+#endif
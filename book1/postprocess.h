@@ -0,0 +1,131 @@
+#ifndef POSTPROCESS_H
+#define POSTPROCESS_H
+
+#include "framebuffer.h"
+#include "parallel.h"
+
+// tone mapping squeezes unbounded linear radiance into [0, 1] before gamma, instead of just clipping it
+enum class tone_mapping
+{
+    none,     // plain clamp in write_color, what we had before
+    reinhard, // c / (1 + c), soft and simple
+    aces      // filmic curve, more contrast and a nicer highlight rolloff
+};
+
+struct postprocess_settings
+{
+    int denoise_passes = 0;                     // a-trous passes, 0 turns the denoiser off, each pass doubles the filter reach
+    double sigma_color = 0.6;                   // how different two pixels' colors can be before they stop blurring together
+    double sigma_normal = 0.3;                  // same for normals, keeps edges between faces sharp
+    double sigma_albedo = 0.1;                  // same for albedo, keeps color boundaries between materials sharp
+    double sigma_depth = 0.1;                   // relative depth difference, keeps silhouettes sharp
+    double exposure = 0.0;                      // in stops, +1 doubles the brightness
+    tone_mapping tone_map = tone_mapping::none; // curve applied after exposure
+};
+
+inline double reinhard(double x)
+{
+    return x / (1.0 + x);
+}
+
+// krzysztof narkowicz's fit of the ACES filmic curve
+inline double aces(double x)
+{
+    return (x * (2.51 * x + 0.03)) / (x * (2.43 * x + 0.59) + 0.14);
+}
+
+// exposure and tone mapping, every pixel on its own so rows can run in parallel
+inline void tone_map_image(framebuffer &fb, double exposure, tone_mapping curve)
+{
+    auto scale = std::pow(2.0, exposure);
+
+    parallel_for_rows(fb.height, [&](int j)
+                      {
+                          for (int i = 0; i < fb.width; i++)
+                          {
+                              color &c = fb.pixels[fb.index(i, j)];
+                              c *= scale;
+                              if (curve == tone_mapping::reinhard)
+                                  c = color(reinhard(c.x()), reinhard(c.y()), reinhard(c.z()));
+                              else if (curve == tone_mapping::aces)
+                                  c = color(aces(c.x()), aces(c.y()), aces(c.z()));
+                          }
+                      });
+}
+
+// how much a neighbor at depth q should count for a pixel at depth p
+// sky pixels (infinity) only blend with other sky pixels
+inline double depth_weight(double p, double q, double sigma)
+{
+    if (std::isinf(p) || std::isinf(q))
+        return std::isinf(p) == std::isinf(q) ? 1.0 : 0.0;
+    return std::exp(-std::fabs(p - q) / (sigma * std::fmax(p, 1e-4)));
+}
+
+// edge-avoiding a-trous wavelet filter (dammertz et al. 2010)
+// each pass blurs with a 5x5 b-spline kernel whose taps are spread out by 1, 2, 4... pixels ("a trous" = with holes)
+// every tap is weighted down when its color, normal, albedo or depth differ from the center pixel
+// so noise inside a surface gets smoothed but edges between objects and materials stay sharp
+inline void denoise(framebuffer &fb, const postprocess_settings &settings)
+{
+    static const double kernel[5] = {1.0 / 16, 1.0 / 4, 3.0 / 8, 1.0 / 4, 1.0 / 16};
+
+    image_buffer<color> out(fb.pixels.size());
+
+    for (int pass = 0; pass < settings.denoise_passes; pass++)
+    {
+        int step = 1 << pass;
+        // color differences shrink after every pass, so we tighten the color weight to match
+        double sigma_c = settings.sigma_color / step;
+
+        parallel_for_rows(fb.height, [&](int j)
+                          {
+                              for (int i = 0; i < fb.width; i++)
+                              {
+                                  int p = fb.index(i, j);
+                                  color sum(0, 0, 0);
+                                  double weight_sum = 0;
+
+                                  for (int dy = -2; dy <= 2; dy++)
+                                  {
+                                      int y = j + dy * step;
+                                      if (y < 0 || y >= fb.height)
+                                          continue;
+                                      for (int dx = -2; dx <= 2; dx++)
+                                      {
+                                          int x = i + dx * step;
+                                          if (x < 0 || x >= fb.width)
+                                              continue;
+                                          int q = fb.index(x, y);
+
+                                          auto w_color = std::exp(-(fb.pixels[p] - fb.pixels[q]).length_squared() / (sigma_c * sigma_c));
+                                          auto w_normal = std::exp(-(fb.normal[p] - fb.normal[q]).length_squared() / (settings.sigma_normal * settings.sigma_normal));
+                                          auto w_albedo = std::exp(-(fb.albedo[p] - fb.albedo[q]).length_squared() / (settings.sigma_albedo * settings.sigma_albedo));
+                                          auto w_depth = depth_weight(fb.depth[p], fb.depth[q], settings.sigma_depth);
+
+                                          auto w = kernel[dx + 2] * kernel[dy + 2] * w_color * w_normal * w_albedo * w_depth;
+                                          sum += w * fb.pixels[q];
+                                          weight_sum += w;
+                                      }
+                                  }
+
+                                  // the center tap always has weight > 0 so this never divides by zero
+                                  out[p] = sum / weight_sum;
+                              }
+                          });
+
+        // next pass reads what this one wrote
+        fb.pixels.swap(out);
+    }
+}
+
+// the whole post processing stage, run once the image is fully rendered
+inline void post_process(framebuffer &fb, const postprocess_settings &settings)
+{
+    if (settings.denoise_passes > 0)
+        denoise(fb, settings);
+    if (settings.exposure != 0.0 || settings.tone_map != tone_mapping::none)
+        tone_map_image(fb, settings.exposure, settings.tone_map);
+}
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef PPM_H
+#define PPM_H
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+// reading back ppm images, both the ascii (P3) kind main writes and the binary (P6) kind most tools export
+// and writing them as binary (P6), for images we make ourselves like the generated texture pattern
+class ppm_image
+{
+public:
+    int width = 0;
+    int height = 0;
+    int max_value = 255;
+    std::vector<color> pixels; // row by row, top row first, components in [0, 1] exactly as stored (still gamma encoded)
+
+    bool load(const std::string &path)
+    {
+        std::ifstream in(path, std::ios::binary);
+        if (!in)
+            return false;
+
+        std::string magic;
+        in >> magic;
+        if (magic != "P3" && magic != "P6")
+            return false;
+
+        if (!read_number(in, width) || !read_number(in, height) || !read_number(in, max_value))
+            return false;
+        if (width <= 0 || height <= 0 || max_value <= 0 || max_value > 255)
+            return false;
+
+        pixels.assign(width * height, color(0, 0, 0));
+        auto scale = 1.0 / max_value;
+
+        if (magic == "P6")
+        {
+            // exactly one whitespace byte separates the header from the binary data
+            in.get();
+            std::vector<unsigned char> bytes(3 * pixels.size());
+            if (!in.read(reinterpret_cast<char *>(bytes.data()), bytes.size()))
+                return false;
+            for (size_t p = 0; p < pixels.size(); p++)
+                pixels[p] = scale * color(bytes[3 * p], bytes[3 * p + 1], bytes[3 * p + 2]);
+            return true;
+        }
+
+        for (auto &pixel : pixels)
+        {
+            int r, g, b;
+            if (!read_number(in, r) || !read_number(in, g) || !read_number(in, b))
+                return false;
+            pixel = scale * color(r, g, b);
+        }
+        return true;
+    }
+
+    // pixels go out as they are, no gamma applied, so load(save(image)) gives back the same bytes
+    bool save(const std::string &path) const
+    {
+        std::ofstream out(path, std::ios::binary);
+        if (!out)
+            return false;
+
+        out << "P6\n"
+            << width << ' ' << height << "\n255\n";
+        static const interval unit(0, 1);
+        std::vector<unsigned char> bytes(3 * pixels.size());
+        for (size_t p = 0; p < pixels.size(); p++)
+            for (int c = 0; c < 3; c++)
+                bytes[3 * p + c] = (unsigned char)(255 * unit.clamp(pixels[p][c]) + 0.5);
+        out.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+        return bool(out);
+    }
+
+private:
+    // skips whitespace and # comments, which the header is allowed to have
+    static bool read_number(std::istream &in, int &value)
+    {
+        in >> std::ws;
+        while (in.peek() == '#')
+        {
+            std::string comment;
+            std::getline(in, comment);
+            in >> std::ws;
+        }
+        return bool(in >> value);
+    }
+};
+
+#endif
@@ -0,0 +1,286 @@
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include "camera.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <cstdint>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// interactive preview: a viewer process connects over a unix socket, we stream frames to it
+// and it sends camera changes back as text lines ("lookfrom x y z", "lookat x y z", "vfov d", "defocus angle dist", "quit")
+// every camera change renders a few passes, each bigger and cleaner than the last,
+// and a change in the middle of a pass cancels the tiles still in flight so the new view starts right away
+
+// sent before the pixels of every frame, the pixels follow as width * height rgb bytes (gamma corrected, top row first)
+struct preview_frame_header
+{
+    char magic[4];           // "RTFR"
+    std::uint32_t width;     // frame size, changes between passes
+    std::uint32_t height;    //
+    std::uint32_t pass;      // 0 = the quickest, rough pass
+    std::uint32_t last_pass; // true when this is the full quality frame for this view
+    std::uint32_t view;      // counts camera changes, so the viewer can tell which change a frame answers
+    float render_ms;         // how long the pass took to render
+};
+
+// write the whole buffer, a socket can take less than we ask for in one go
+inline bool send_all(int fd, const void *data, size_t size)
+{
+    auto bytes = static_cast<const char *>(data);
+    while (size > 0)
+    {
+        auto sent = ::write(fd, bytes, size);
+        if (sent <= 0)
+            return false;
+        bytes += sent;
+        size -= size_t(sent);
+    }
+    return true;
+}
+
+// read exactly size bytes, false if the other side hung up first
+inline bool receive_all(int fd, void *data, size_t size)
+{
+    auto bytes = static_cast<char *>(data);
+    while (size > 0)
+    {
+        auto got = ::read(fd, bytes, size);
+        if (got <= 0)
+            return false;
+        bytes += got;
+        size -= size_t(got);
+    }
+    return true;
+}
+
+class preview_server
+{
+public:
+    // cam holds the full quality settings, the passes before the last one scale them down
+    // the scene is prepared once by the caller, every pass of every view reuses it
+    preview_server(const render_scene &scene, const camera &cam) : scene(scene), view_camera(cam) {}
+
+    // wait for a viewer on socket_path and serve it until it sends quit or disconnects
+    bool serve(const std::string &socket_path)
+    {
+        // a viewer that goes away mid-write should end the session, not kill us with SIGPIPE
+        std::signal(SIGPIPE, SIG_IGN);
+
+        int server_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (server_fd < 0)
+            return false;
+
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        std::strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+        ::unlink(socket_path.c_str());
+
+        if (::bind(server_fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 || ::listen(server_fd, 1) < 0)
+        {
+            ::close(server_fd);
+            return false;
+        }
+
+        std::clog << "preview: waiting for a viewer on " << socket_path << std::endl;
+        client_fd = ::accept(server_fd, nullptr, nullptr);
+        ::close(server_fd);
+        ::unlink(socket_path.c_str());
+        if (client_fd < 0)
+            return false;
+        std::clog << "preview: viewer connected" << std::endl;
+
+        std::thread commands([this]()
+                             { read_commands(); });
+        render_loop();
+
+        // wakes the command reader up if it's still blocked reading
+        ::shutdown(client_fd, SHUT_RDWR);
+        commands.join();
+        ::close(client_fd);
+        return true;
+    }
+
+private:
+    // one step of the progressive refinement, the image is divided down and uses fewer samples and bounces
+    struct pass_settings
+    {
+        int divisor;
+        int samples_per_pixel;
+        int max_depth;
+        int denoise_passes;
+    };
+
+    const render_scene &scene;
+    int client_fd = -1;
+
+    std::mutex lock;                 // guards everything below it
+    std::condition_variable changed; // signaled on a new view or quit
+    camera view_camera;              // latest settings from the viewer
+    std::uint32_t view = 1;          // bumped on every camera change
+    bool quit = false;
+
+    std::atomic<bool> cancel{false}; // set to abort the pass that's rendering
+
+    void render_loop()
+    {
+        std::uint32_t rendered_view = 0;
+
+        while (true)
+        {
+            camera cam;
+            std::uint32_t current_view;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                changed.wait(guard, [&]()
+                             { return quit || view != rendered_view; });
+                if (quit)
+                    return;
+                cam = view_camera;
+                current_view = view;
+                cancel = false;
+            }
+
+            // the first pass is tiny, noisy and denoised so something shows up fast
+            // the last one is what the camera was set up for
+            const pass_settings passes[] = {
+                {4, 1, std::min(cam.max_depth, 4), 2},
+                {2, 4, std::min(cam.max_depth, 8), 2},
+                {1, cam.samples_per_pixel, cam.max_depth, cam.post.denoise_passes},
+            };
+            const int pass_count = sizeof(passes) / sizeof(passes[0]);
+
+            bool finished = true;
+            for (int pass = 0; pass < pass_count; pass++)
+            {
+                camera pass_cam = cam;
+                pass_cam.image_width = std::max(1, cam.image_width / passes[pass].divisor);
+                pass_cam.samples_per_pixel = passes[pass].samples_per_pixel;
+                pass_cam.max_depth = passes[pass].max_depth;
+                pass_cam.post.denoise_passes = passes[pass].denoise_passes;
+                pass_cam.show_progress = false;
+
+                auto start = std::chrono::steady_clock::now();
+                framebuffer fb;
+                if (!pass_cam.render_frame(scene, fb, &cancel))
+                {
+                    // the camera moved, start over with the new view
+                    finished = false;
+                    break;
+                }
+                std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+                if (!send_frame(fb, pass, pass == pass_count - 1, current_view, elapsed.count()))
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    quit = true;
+                    return;
+                }
+            }
+
+            if (finished)
+                rendered_view = current_view;
+        }
+    }
+
+    bool send_frame(const framebuffer &fb, int pass, bool last_pass, std::uint32_t frame_view, double render_ms)
+    {
+        preview_frame_header header = {{'R', 'T', 'F', 'R'}, std::uint32_t(fb.width), std::uint32_t(fb.height),
+                                       std::uint32_t(pass), std::uint32_t(last_pass), frame_view, float(render_ms)};
+
+        std::vector<unsigned char> bytes(3 * fb.pixels.size());
+        for (size_t p = 0; p < fb.pixels.size(); p++)
+        {
+            bytes[3 * p] = (unsigned char)component_to_byte(fb.pixels[p].x());
+            bytes[3 * p + 1] = (unsigned char)component_to_byte(fb.pixels[p].y());
+            bytes[3 * p + 2] = (unsigned char)component_to_byte(fb.pixels[p].z());
+        }
+
+        return send_all(client_fd, &header, sizeof(header)) && send_all(client_fd, bytes.data(), bytes.size());
+    }
+
+    // runs on its own thread, one text command per line
+    void read_commands()
+    {
+        std::string pending;
+        char buffer[256];
+
+        while (true)
+        {
+            auto got = ::read(client_fd, buffer, sizeof(buffer));
+            if (got <= 0)
+                break;
+            pending.append(buffer, size_t(got));
+
+            size_t newline;
+            while ((newline = pending.find('\n')) != std::string::npos)
+            {
+                std::string line = pending.substr(0, newline);
+                pending.erase(0, newline + 1);
+                if (!apply_command(line))
+                    return;
+            }
+        }
+
+        // viewer hung up
+        std::lock_guard<std::mutex> guard(lock);
+        quit = true;
+        cancel = true;
+        changed.notify_all();
+    }
+
+    // returns false once we've been told to quit
+    bool apply_command(const std::string &line)
+    {
+        std::istringstream in(line);
+        std::string command;
+        in >> command;
+
+        std::lock_guard<std::mutex> guard(lock);
+        camera next = view_camera;
+        double x, y, z;
+
+        if (command == "quit")
+            quit = true;
+        else if (command == "lookfrom" && in >> x >> y >> z)
+            next.lookfrom = point3(x, y, z);
+        else if (command == "lookat" && in >> x >> y >> z)
+            next.lookat = point3(x, y, z);
+        else if (command == "vfov" && in >> x)
+            next.vfov = x;
+        else if (command == "defocus" && in >> x >> y)
+        {
+            next.defocus_angle = x;
+            next.focus_dist = y;
+        }
+        else
+        {
+            std::clog << "preview: ignoring command '" << line << "'" << std::endl;
+            return true;
+        }
+
+        if (!quit)
+        {
+            view_camera = next;
+            view++;
+        }
+        // whatever is rendering now is for the old view, drop it
+        cancel = true;
+        changed.notify_all();
+        return !quit;
+    }
+};
+
+#endif
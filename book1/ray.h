@@ -38,4 +38,37 @@ private:
     // orig and dir are handled inside the class, origin and direction can be accessed by outside
 };
 
+// a camera ray plus two neighbors offset by one pixel right (x) and one pixel down (y)
+// following them tells us how big a pixel is where the ray lands, so textures can be filtered to match
+class ray_differential : public ray
+{
+public:
+    point3 rx_origin, ry_origin;
+    vec3 rx_direction, ry_direction;
+
+    ray_differential() {}
+    ray_differential(const point3 &origin, const vec3 &direction,
+                     const point3 &rx_origin, const vec3 &rx_direction,
+                     const point3 &ry_origin, const vec3 &ry_direction)
+        : ray(origin, direction),
+          rx_origin(rx_origin), ry_origin(ry_origin), rx_direction(rx_direction), ry_direction(ry_direction)
+    {
+    }
+
+    // width of the pixel footprint at hit point p on a surface with normal n
+    // we hit the tangent plane at p with both neighbor rays and see how far from p they land
+    // returns 0 if a neighbor runs parallel to the plane and never hits it
+    double footprint(const point3 &p, const vec3 &n) const
+    {
+        auto dx = dot(n, rx_direction);
+        auto dy = dot(n, ry_direction);
+        if (std::fabs(dx) < 1e-12 || std::fabs(dy) < 1e-12)
+            return 0;
+
+        point3 px = rx_origin + (dot(n, p - rx_origin) / dx) * rx_direction;
+        point3 py = ry_origin + (dot(n, p - ry_origin) / dy) * ry_direction;
+        return std::fmax((px - p).length(), (py - p).length());
+    }
+};
+
 #endif
\ No newline at end of file
@@ -0,0 +1,79 @@
+#ifndef RENDER_SCENE_H
+#define RENDER_SCENE_H
+
+#include "clustered_scene.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "numa.h"
+#include "sphere_list.h"
+
+// a scene as the renderer sees it, worked out once when the scene is loaded and reused for every frame
+// it decides which kernel the scene's features allow and keeps the flat sphere copy that kernel reads,
+// so preview passes and repeated renders don't redo the dynamic_casts and the copy every time
+class render_scene
+{
+public:
+    const hittable &world;
+
+    // with numa_aware set, sphere scenes also get one deep copy per numa node, built by a thread on that node
+    explicit render_scene(const hittable &world, bool numa_aware = false) : world(world)
+    {
+        // out-of-core scenes trace each tile's rays as one batch, cluster by cluster
+        clustered = dynamic_cast<const clustered_scene *>(&world);
+        if (!clustered)
+            spheres = as_sphere_list(world, flattened);
+
+        // pinned renders need the nodes even for a scene that wasn't copied, its nodes just all share it
+        topology = detect_numa_topology();
+        if (numa_aware && spheres)
+            node_copies = copy_per_node<sphere_list>(topology, [&]()
+                                                     { return spheres->deep_copy(); });
+    }
+
+    // spheres may point into flattened, a copy would point into the original's
+    render_scene(const render_scene &) = delete;
+    render_scene &operator=(const render_scene &) = delete;
+
+    // which kernel the scene can run, at most one of these is set
+    const clustered_scene *clustered_world() const { return clustered; }
+    const sphere_list *sphere_world() const { return spheres; }
+
+    const numa_topology &numa_nodes() const { return topology; }
+    // the sphere list the threads on node should read, their own copy if the scene was prepared for numa
+    const sphere_list &sphere_world_on(int node) const { return node_copies.empty() ? *spheres : *node_copies[node]; }
+
+private:
+    const clustered_scene *clustered = nullptr;
+    const sphere_list *spheres = nullptr;
+    sphere_list flattened;
+    numa_topology topology;
+    std::vector<std::unique_ptr<sphere_list>> node_copies;
+
+    // the sphere kernel can run when the world is a sphere_list, or a hittable_list holding nothing but spheres
+    // a hittable_list of spheres gets copied flat into a sphere_list for that, hits then go straight to sphere::hit
+    // returns the list to render, or nullptr if the scene has anything else in it
+    static const sphere_list *as_sphere_list(const hittable &world, sphere_list &flattened)
+    {
+        if (auto spheres = dynamic_cast<const sphere_list *>(&world))
+            return spheres;
+
+        auto list = dynamic_cast<const hittable_list *>(&world);
+        if (!list)
+            return nullptr;
+
+        flattened.spheres.reserve(list->objects.size());
+        for (const auto &object : list->objects)
+        {
+            auto s = dynamic_cast<const sphere *>(object.get());
+            if (!s)
+            {
+                flattened.spheres.clear();
+                return nullptr;
+            }
+            flattened.add(*s);
+        }
+        return &flattened;
+    }
+};
+
+#endif
@@ -6,6 +6,7 @@
 #include <iostream>
 #include <limits>
 #include <memory>
+#include <random>
 
 // std using
 using std::make_shared;
@@ -24,12 +25,25 @@ inline double degrees_to_radians(double degrees)
     return degrees * pi / 180.0;
 }
 
+// every thread gets its own generator, std::rand has one shared state that threads would fight over
+// (and the numbers each thread gets would depend on timing, so renders wouldn't be repeatable)
+inline std::mt19937 &random_generator()
+{
+    thread_local std::mt19937 generator;
+    return generator;
+}
+
+// restart this thread's random sequence, the camera does this per tile so tiles render the same on any thread
+inline void seed_random(unsigned int seed)
+{
+    random_generator().seed(seed);
+}
+
 inline double random_double()
 {
     // return random real in [0,1)
-    return std::rand() / (RAND_MAX + 1.0);
-
-    // never reaches 1.0 bc rand() will always be smaller than RAND_MAX+1.0
+    static thread_local std::uniform_real_distribution<double> distribution(0.0, 1.0);
+    return distribution(random_generator());
 }
 
 inline double random_double(double min, double max)
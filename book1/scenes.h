@@ -0,0 +1,268 @@
+#ifndef SCENES_H
+#define SCENES_H
+
+#include "material.h"
+#include "parallel.h"
+#include "sphere_list.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// parametric scenes for scaling studies, anywhere from a handful to hundreds of millions of spheres
+// every sphere is generated from its own index, so we can fill the array from many threads at once
+// and still get the same scene no matter how many threads did it
+// the generators write into a sphere_list, or into anything else with add(sphere) like a cluster_file_writer
+
+// small random number generator seeded per sphere (splitmix64)
+// std::rand has one shared state, it isn't safe or repeatable across threads
+class index_random
+{
+public:
+    index_random(std::uint64_t seed, std::uint64_t index) : state(seed * 0x9E3779B97F4A7C15ull + index) {}
+
+    std::uint64_t next()
+    {
+        std::uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    // random real in [0,1), top 53 bits so every double in the range can come out
+    double real() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+
+    double real(double min, double max) { return min + (max - min) * real(); }
+
+    vec3 unit_vector()
+    {
+        while (true)
+        {
+            vec3 p(real(-1, 1), real(-1, 1), real(-1, 1));
+            auto lensq = p.length_squared();
+            if (1e-160 < lensq && lensq <= 1)
+                return p / std::sqrt(lensq);
+        }
+    }
+
+private:
+    std::uint64_t state;
+};
+
+// a fixed set of materials every generated sphere picks from
+// one material per sphere would mean a heap allocation each, that's most of the memory at 10^8 spheres
+class material_palette
+{
+public:
+    std::vector<shared_ptr<material>> materials;
+
+    material_palette(std::uint64_t seed, int size = 64)
+    {
+        for (int m = 0; m < size; m++)
+        {
+            index_random rng(seed, m);
+            auto choose_mat = rng.real();
+
+            // same odds as the book's final scene: 80% diffuse, 15% metal, 5% glass
+            if (choose_mat < 0.8)
+            {
+                color a(rng.real(), rng.real(), rng.real());
+                color b(rng.real(), rng.real(), rng.real());
+                materials.push_back(make_shared<lambertian>(a * b));
+            }
+            else if (choose_mat < 0.95)
+                materials.push_back(make_shared<metal>(color(rng.real(0.5, 1), rng.real(0.5, 1), rng.real(0.5, 1)), rng.real(0, 0.5)));
+            else
+                materials.push_back(make_shared<dielectric>(1.5));
+        }
+    }
+
+    const shared_ptr<material> &pick(index_random &rng) const
+    {
+        return materials[rng.next() % materials.size()];
+    }
+
+    // the same material objects, behind reference counts of their own
+    // every sphere that gets a material copies a shared_ptr, an atomic increment on the material's count,
+    // so threads filling spheres from one palette would all fight over the same 64 counts
+    // generate_spheres gives every chunk its own copy, then spheres only share counts within their chunk
+    material_palette local_copy() const
+    {
+        material_palette copy;
+        for (const auto &mat : materials)
+            // a new count whose deleter holds on to the original, the material lives as long as either does
+            copy.materials.push_back(shared_ptr<material>(mat.get(), [mat](material *) {}));
+        return copy;
+    }
+
+private:
+    material_palette() {}
+};
+
+// fills spheres[first, first + count) with make_sphere(index, palette), split into chunks across the cores
+// make_sphere picks materials from the palette it's handed, a local copy of palette for its chunk
+template <typename F>
+void generate_spheres(sphere_list &list, size_t count, const material_palette &palette, F make_sphere)
+{
+    size_t first = list.spheres.size();
+    // placeholder spheres so the array is allocated once and each thread just overwrites its slots
+    list.spheres.resize(first + count, sphere(point3(0, 0, 0), 0, nullptr));
+
+    const size_t chunk = 1 << 16;
+    int chunks = int((count + chunk - 1) / chunk);
+    parallel_for_rows(chunks, [&](int c)
+                      {
+                          material_palette local = palette.local_copy();
+                          size_t end = std::min(count, (c + 1) * chunk);
+                          for (size_t i = c * chunk; i < end; i++)
+                              list.spheres[first + i] = make_sphere(i, local);
+                      });
+}
+
+// the same for outputs that take spheres one at a time, like a cluster file being written
+// one chunk is generated across the cores and handed over before the next, so only a chunk is ever in memory
+template <typename Output, typename F>
+void generate_spheres(Output &out, size_t count, const material_palette &palette, F make_sphere)
+{
+    const size_t chunk = 1 << 20;
+    const size_t slice = 1 << 16;
+    std::vector<sphere> spheres;
+    for (size_t first = 0; first < count; first += chunk)
+    {
+        size_t size = std::min(chunk, count - first);
+        spheres.assign(size, sphere(point3(0, 0, 0), 0, nullptr));
+        int slices = int((size + slice - 1) / slice);
+        parallel_for_rows(slices, [&](int c)
+                          {
+                              material_palette local = palette.local_copy();
+                              size_t end = std::min(size, (c + 1) * slice);
+                              for (size_t i = c * slice; i < end; i++)
+                                  spheres[i] = make_sphere(first + i, local);
+                          });
+        for (const auto &s : spheres)
+            out.add(s);
+    }
+}
+
+// the book's final scene: a ground sphere, three big spheres and n small random ones
+// the small spheres sit on a jittered square grid that grows with n so they never overlap
+template <typename Output>
+void random_sphere_field(Output &list, size_t n, std::uint64_t seed = 1)
+{
+    const double small_radius = 0.2;
+    const double jitter = 0.9;
+    const double clearance = 0.9;
+    const point3 big_centers[3] = {point3(0, 1, 0), point3(-4, 1, 0), point3(4, 1, 0)};
+
+    // grid cells where a small sphere could end up inside one of the big ones are left empty
+    // (the book's "> 0.9 away" check, but decided per cell so sphere i can still be placed on its own)
+    // a small sphere near the origin sits 0.8 below a big center, so it needs sqrt(1.2^2 - 0.8^2) ~ 0.9 of horizontal room
+    int side = int(std::ceil(std::sqrt(double(n))));
+    std::vector<size_t> blocked;
+    while (true)
+    {
+        blocked.clear();
+        for (const auto &big : big_centers)
+        {
+            int first_b = int(std::floor(big.z() - clearance - jitter + side / 2.0));
+            int first_a = int(std::floor(big.x() - clearance - jitter + side / 2.0));
+            for (int cb = std::max(first_b, 0); cb <= std::min(first_b + 3, side - 1); cb++)
+                for (int ca = std::max(first_a, 0); ca <= std::min(first_a + 3, side - 1); ca++)
+                {
+                    // nearest point of the cell's jitter square to the big sphere, horizontally
+                    double a = ca - side / 2.0, b = cb - side / 2.0;
+                    double dx = std::fmax(0.0, std::fmax(a - big.x(), big.x() - (a + jitter)));
+                    double dz = std::fmax(0.0, std::fmax(b - big.z(), big.z() - (b + jitter)));
+                    if (dx * dx + dz * dz < clearance * clearance)
+                        blocked.push_back(size_t(cb) * side + ca);
+                }
+        }
+        if (size_t(side) * side >= n + blocked.size())
+            break;
+        side++;
+    }
+    std::sort(blocked.begin(), blocked.end());
+    blocked.erase(std::unique(blocked.begin(), blocked.end()), blocked.end());
+
+    // the ground has to stay flat-ish under a bigger field
+    double ground_radius = std::fmax(1000, 10.0 * side);
+
+    list.add(sphere(point3(0, -ground_radius, 0), ground_radius, make_shared<lambertian>(color(0.5, 0.5, 0.5))));
+    list.add(sphere(big_centers[0], 1.0, make_shared<dielectric>(1.5)));
+    list.add(sphere(big_centers[1], 1.0, make_shared<lambertian>(color(0.4, 0.2, 0.1))));
+    list.add(sphere(big_centers[2], 1.0, make_shared<metal>(color(0.7, 0.6, 0.5), 0.0)));
+
+    material_palette palette(seed);
+    generate_spheres(list, n, palette, [&](size_t i, const material_palette &local)
+                     {
+                         // the i-th cell that isn't blocked
+                         size_t cell = i;
+                         for (size_t b : blocked)
+                             if (b <= cell)
+                                 cell++;
+
+                         index_random rng(seed, i);
+                         double x = double(cell % side) - side / 2.0 + jitter * rng.real();
+                         double z = double(cell / side) - side / 2.0 + jitter * rng.real();
+                         // resting on the ground, which curves down away from the origin
+                         double y = -ground_radius + std::sqrt((ground_radius + small_radius) * (ground_radius + small_radius) - x * x - z * z);
+                         return sphere(point3(x, y, z), small_radius, local.pick(rng));
+                     });
+}
+
+// n spheres on a uniform cube lattice with unit spacing, centered on the origin
+template <typename Output>
+void sphere_grid(Output &list, size_t n, std::uint64_t seed = 1)
+{
+    size_t side = size_t(std::ceil(std::cbrt(double(n))));
+    double half = (side - 1) / 2.0;
+
+    material_palette palette(seed);
+    generate_spheres(list, n, palette, [&](size_t i, const material_palette &local)
+                     {
+                         index_random rng(seed, i);
+                         point3 center(double(i % side) - half, double((i / side) % side) - half, double(i / (side * side)) - half);
+                         return sphere(center, 0.4, local.pick(rng));
+                     });
+}
+
+// clustered fractal distribution (soneira-peebles style): 8 clusters, each made of 8 smaller clusters and so on
+// a sphere's position is the sum of one random offset per level, shrinking by half each level down,
+// and the offsets depend only on the path of cluster indices so every sphere can be placed on its own
+// this gives very dense clumps and lots of empty space, the worst case for a flat list and a good test for acceleration structures
+template <typename Output>
+void fractal_cluster(Output &list, size_t n, std::uint64_t seed = 1)
+{
+    int levels = 1;
+    size_t leaves = 8;
+    while (leaves < n)
+    {
+        leaves *= 8;
+        levels++;
+    }
+
+    const double top_radius = 4.0;
+    double sphere_radius = top_radius * std::pow(0.5, levels) * 0.5;
+
+    material_palette palette(seed);
+    generate_spheres(list, n, palette, [&](size_t i, const material_palette &local)
+                     {
+                         point3 center(0, 0, 0);
+                         double scale = top_radius;
+                         size_t digits = leaves / 8;
+                         size_t path = 0;
+                         for (int level = 0; level < levels; level++)
+                         {
+                             // the base 8 digits of i, most significant first, pick a sub-cluster at every level
+                             path = path * 8 + (i / digits) % 8;
+                             digits = digits > 1 ? digits / 8 : 1;
+                             index_random cluster_rng(seed + level + 1, path);
+                             center += scale * cluster_rng.unit_vector();
+                             scale *= 0.5;
+                         }
+                         index_random rng(seed, i);
+                         return sphere(center, sphere_radius, local.pick(rng));
+                     });
+}
+
+#endif
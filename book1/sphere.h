@@ -1,9 +1,10 @@
 #ifndef SPHERE_H
 #define SPHERE_H
 
+#include "aabb.h"
 #include "hittable.h"
 
-class sphere : public hittable
+class sphere final : public hittable
 {
 public:
     // point3 for sphere center, double for sphere radius
@@ -13,6 +14,20 @@ public:
     // fmax (float max) ensures radius can never be negative, takes the maximum of 0 and entered radius
 
     bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+    {
+        double root;
+        if (!nearest_root(center, radius, r, ray_t, root))
+            return false;
+
+        set_hit_record(center, radius, mat, r, root, rec);
+
+        // we have a hit
+        return true;
+    }
+
+    // nearest t in ray_t where the ray meets the sphere, false if there isn't one
+    // static so spheres that aren't stored as sphere objects (like the out-of-core clusters) can share the math
+    static bool nearest_root(const point3 &center, double radius, const ray &r, interval ray_t, double &root)
     {
         // vector from the ray's origin to the sphere's center
         vec3 oc = center - r.origin();
@@ -38,7 +53,7 @@ public:
         // find nearest root in the acceptable range
 
         // root according to quadratic formula, h+-sqrtd / a, h instead of b/2 and a instead of 2a
-        auto root = (h - sqrtd) / a;
+        root = (h - sqrtd) / a;
         if (!ray_t.surrounds(root))
         // if root is outside our limits check again
         {
@@ -48,8 +63,13 @@ public:
                 return false;
         }
 
-        // update hit record
+        return true;
+    }
 
+    // fill in the hit record for a hit at t = root
+    static void set_hit_record(const point3 &center, double radius, const shared_ptr<material> &mat,
+                               const ray &r, double root, hit_record &rec)
+    {
         // hit point
         rec.t = root;
         // the hit point on the sphere's surface
@@ -58,14 +78,57 @@ public:
         vec3 outward_normal = (rec.p - center) / radius;
         // the ray, the outward normal (unit length)
         rec.set_face_normal(r, outward_normal);
+        // texture coordinates of the hit point
+        get_sphere_uv(outward_normal, rec.u, rec.v);
+        // v goes from 0 to 1 over half the circumference
+        rec.uv_rate = 1 / (pi * radius);
         // material
         rec.mat = mat;
+    }
 
-        // we have a hit
-        return true;
+    // same math as hit() but we stop once we know either root is in range
+    // no hit point, normal, face check or material copy (shared_ptr copy touches the ref counter)
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        vec3 oc = center - r.origin();
+        auto a = r.direction().length_squared();
+        auto h = dot(r.direction(), oc);
+        auto c = oc.length_squared() - radius * radius;
+
+        auto discriminant = h * h - a * c;
+        if (discriminant < 0)
+            return false;
+
+        auto sqrtd = std::sqrt(discriminant);
+
+        // either root inside the range means something blocks the ray
+        return ray_t.surrounds((h - sqrtd) / a) || ray_t.surrounds((h + sqrtd) / a);
+    }
+
+    const point3 &get_center() const { return center; }
+    double get_radius() const { return radius; }
+    const shared_ptr<material> &get_material() const { return mat; }
+
+    // box that fits the whole sphere
+    aabb bounding_box() const
+    {
+        vec3 rvec(radius, radius, radius);
+        return aabb(center - rvec, center + rvec);
     }
 
 private:
+    // p is a point on the unit sphere around the origin (the outward normal works)
+    // u: angle around the y axis from x=-1, mapped to [0,1]
+    // v: angle from y=-1 up to y=+1, mapped to [0,1]
+    static void get_sphere_uv(const point3 &p, double &u, double &v)
+    {
+        auto theta = std::acos(-p.y());
+        auto phi = std::atan2(-p.z(), p.x()) + pi;
+
+        u = phi / (2 * pi);
+        v = theta / pi;
+    }
+
     // private vars for encapsulation
     // we can't modify these directly but we can create a sphere with these
     point3 center;
@@ -0,0 +1,68 @@
+#ifndef SPHERE_LIST_H
+#define SPHERE_LIST_H
+
+#include "hittable.h"
+#include "material.h"
+#include "sphere.h"
+
+#include <unordered_map>
+#include <vector>
+
+// like hittable_list but the spheres sit by value in one contiguous array
+// no allocation or pointer chasing per object, and since sphere is final the hit calls aren't virtual
+// this is what the procedural scenes generate into, they can have millions of spheres
+class sphere_list final : public hittable
+{
+public:
+    std::vector<sphere> spheres;
+
+    void add(const sphere &s) { spheres.push_back(s); }
+
+    // a copy that shares nothing it touches per hit with this list, every distinct material is cloned once
+    // (a plain copy would still point at the same materials, and every hit bumps their shared reference count)
+    sphere_list deep_copy() const
+    {
+        sphere_list copy;
+        copy.spheres.reserve(spheres.size());
+        std::unordered_map<const material *, shared_ptr<material>> cloned;
+        for (const auto &s : spheres)
+        {
+            auto &mat = cloned[s.get_material().get()];
+            if (!mat)
+                mat = s.get_material()->clone();
+            copy.add(sphere(s.get_center(), s.get_radius(), mat));
+        }
+        return copy;
+    }
+
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+    {
+        bool hit_anything = false;
+        auto closest_so_far = ray_t.max;
+
+        // the spheres write straight into rec, a miss never touches it so we don't need a temporary record
+        for (const auto &s : spheres)
+        {
+            if (s.hit(r, interval(ray_t.min, closest_so_far), rec))
+            {
+                hit_anything = true;
+                closest_so_far = rec.t;
+            }
+        }
+
+        return hit_anything;
+    }
+
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        for (const auto &s : spheres)
+        {
+            if (s.occluded(r, ray_t))
+                return true;
+        }
+
+        return false;
+    }
+};
+
+#endif
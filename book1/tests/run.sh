@@ -0,0 +1,89 @@
+#!/bin/sh
+# regression test: renders every scene in scenes.txt at a fixed size and seed and compares it with its reference image
+# a scene fails if the image is further off than its psnr/rmse limits, or if it renders slower than its baseline time
+# plus the margin (PERF_MARGIN, a fraction, 0.5 = up to 50% slower is fine) and PERF_SLACK seconds,
+# which keeps timer noise on the quickest scenes from failing them
+# a scene over its limit is timed again, up to PERF_RUNS renders in all, and its fastest one counts
+# usage: tests/run.sh path/to/main path/to/imgdiff [--record]
+# --record renders every scene and stores it as the new reference and its time as the new baseline
+
+main=$1
+imgdiff=$2
+record=$3
+margin=${PERF_MARGIN:-0.5}
+slack=${PERF_SLACK:-0.1}
+runs=${PERF_RUNS:-3}
+here=$(cd "$(dirname "$0")" && pwd)
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# small and quick, but big enough that a broken shading path shows up in the psnr
+size="--width 160 --samples 16 --seed 1"
+
+# renders one scene into $tmp/$name.ppm and prints how long it took, the time main reports as "Done in"
+render() {
+    $main $args $size > "$tmp/$name.ppm" 2> "$tmp/$name.log" || return 1
+    seconds=$(tr '\r' '\n' < "$tmp/$name.log" | sed -n 's/^Done in \([0-9.e+-]*\) s.*/\1/p' | tail -1)
+    echo "${seconds:-0}"
+}
+
+failed=0
+: > "$tmp/scenes.txt"
+
+while IFS= read -r line; do
+    case "$line" in
+    '#'* | '')
+        echo "$line" >> "$tmp/scenes.txt"
+        continue
+        ;;
+    esac
+
+    set -- $line
+    name=$1 min_psnr=$2 max_rmse=$3 baseline=$4
+    shift 4
+    args=$(echo "$*" | sed "s|{tmp}|$tmp|g")
+
+    if ! seconds=$(render); then
+        echo "$name: FAIL, render exited with an error"
+        failed=1
+        echo "$line" >> "$tmp/scenes.txt"
+        continue
+    fi
+
+    if [ "$record" = "--record" ]; then
+        # the baseline is the fastest of all the runs, the same way a test run is timed
+        run=1
+        while [ $run -lt $runs ]; do
+            again=$(render) && seconds=$(awk "BEGIN { print ($again < $seconds) ? $again : $seconds }")
+            run=$((run + 1))
+        done
+        cp "$tmp/$name.ppm" "$here/references/$name.ppm"
+        printf '%-9s %-3s %-2s %-8.3f %s\n' "$name" "$min_psnr" "$max_rmse" "$seconds" "$*" >> "$tmp/scenes.txt"
+        echo "$name: recorded, $seconds s"
+        continue
+    fi
+
+    status=PASS
+    diff=$($imgdiff "$here/references/$name.ppm" "$tmp/$name.ppm" "$min_psnr" "$max_rmse") || status=FAIL
+    diff=$(echo "$diff" | head -1)
+    limit=$(awk "BEGIN { print $baseline * (1 + $margin) + $slack }")
+    # the image is already checked, the fixed seed makes every render of it the same, these runs are only for timing
+    run=1
+    while [ $run -lt $runs ] && awk "BEGIN { exit !($baseline > 0 && $seconds > $limit) }"; do
+        again=$(render) && seconds=$(awk "BEGIN { print ($again < $seconds) ? $again : $seconds }")
+        run=$((run + 1))
+    done
+    if awk "BEGIN { exit !($baseline > 0 && $seconds > $limit) }"; then
+        status="FAIL (slower than $limit s)"
+    fi
+    [ "$status" = PASS ] || failed=1
+    echo "$name: $status, $diff, $seconds s (baseline $baseline s)"
+done < "$here/scenes.txt"
+
+if [ "$record" = "--record" ]; then
+    cp "$tmp/scenes.txt" "$here/scenes.txt"
+    exit 0
+fi
+
+[ $failed = 0 ] && echo "all scenes passed" || echo "some scenes failed"
+exit $failed
@@ -0,0 +1,68 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#include "texture_cache.h"
+
+// a texture gives a color for a point on a surface, u,v are the surface coordinates from the hit record
+class texture
+{
+public:
+    virtual ~texture() = default;
+
+    virtual color value(double u, double v, const point3 &p) const = 0;
+
+    // color averaged over a patch uv_width wide around u,v, so we don't alias when a pixel covers many texels
+    // textures with no detail to lose just return value()
+    virtual color filtered_value(double u, double v, const point3 &p, double uv_width) const
+    {
+        return value(u, v, p);
+    }
+};
+
+// the same color everywhere, what materials used to store directly
+class solid_color : public texture
+{
+public:
+    solid_color(const color &albedo) : albedo(albedo) {}
+
+    solid_color(double red, double green, double blue) : solid_color(color(red, green, blue)) {}
+
+    color value(double u, double v, const point3 &p) const override
+    {
+        return albedo;
+    }
+
+    const color &get_albedo() const { return albedo; }
+
+private:
+    color albedo;
+};
+
+// an image read through the texture cache, only the tiles we actually hit get loaded
+class image_texture : public texture
+{
+public:
+    // handle comes from cache->open(), the cache can be shared by any number of textures and threads
+    image_texture(shared_ptr<texture_cache> cache, int handle) : cache(cache), handle(handle) {}
+
+    color value(double u, double v, const point3 &p) const override
+    {
+        // no footprint, full resolution
+        return cache->sample(handle, u, v, 0);
+    }
+
+    // pick the mip level where one texel is about as wide as the footprint
+    // every level halves the resolution, so that's log2 of how many full size texels the footprint covers
+    color filtered_value(double u, double v, const point3 &p, double uv_width) const override
+    {
+        auto texels = uv_width * std::max(cache->width(handle), cache->height(handle));
+        int level = texels > 1 ? int(std::log2(texels)) : 0;
+        return cache->sample(handle, u, v, level);
+    }
+
+private:
+    shared_ptr<texture_cache> cache;
+    int handle;
+};
+
+#endif
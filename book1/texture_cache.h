@@ -0,0 +1,376 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include "ppm.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// image textures live on disk as a chain of mip levels, each cut into square tiles
+// the cache only keeps the tiles rays actually touched, and throws out the least recently used ones
+// once it's over its memory budget, so the textures in a scene can be much bigger than RAM
+//
+// file layout (little endian as written by this machine):
+//   header: "RTTX", width, height, tile size, level count (4 x uint32)
+//   then every level from 0 (full size) down to 1x1, tiles row by row,
+//   each tile tile_size * tile_size rgb bytes, padded past the image edge
+
+struct texture_file_header
+{
+    char magic[4];
+    std::uint32_t width;
+    std::uint32_t height;
+    std::uint32_t tile_size;
+    std::uint32_t levels;
+};
+
+// size of level l of a w x h image, never smaller than 1 pixel
+inline int mip_size(int size, int level)
+{
+    int s = size >> level;
+    return s > 0 ? s : 1;
+}
+
+inline int tiles_across(int size, int tile_size)
+{
+    return (size + tile_size - 1) / tile_size;
+}
+
+// a test image with detail at every scale: small checkers in two colors whose hue drifts across the image
+// far away the checkers should blur into their average, which makes mip level mistakes easy to spot
+inline ppm_image checker_pattern(int width, int height, int checker = 8)
+{
+    ppm_image image;
+    image.width = width;
+    image.height = height;
+    image.pixels.resize(size_t(width) * height);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+        {
+            double s = double(x) / width;
+            double t = double(y) / height;
+            bool odd = ((x / checker) + (y / checker)) % 2 == 1;
+            image.pixels[size_t(y) * width + x] = odd ? color(0.9, 0.9, 0.85) : color(0.2 + 0.6 * s, 0.3, 0.2 + 0.6 * t);
+        }
+    return image;
+}
+
+// convert a ppm into the tiled mip-mapped format above, done once ahead of rendering
+// mips are averaged in linear space (we undo our sqrt gamma first) and stored gamma encoded again
+inline bool write_tiled_texture(const std::string &ppm_path, const std::string &out_path, int tile_size = 64)
+{
+    ppm_image image;
+    if (!image.load(ppm_path))
+        return false;
+
+    std::vector<color> level_pixels(image.pixels.size());
+    for (size_t p = 0; p < level_pixels.size(); p++)
+        level_pixels[p] = image.pixels[p] * image.pixels[p];
+
+    int levels = 1;
+    while (mip_size(image.width, levels - 1) > 1 || mip_size(image.height, levels - 1) > 1)
+        levels++;
+
+    std::ofstream out(out_path, std::ios::binary);
+    if (!out)
+        return false;
+
+    texture_file_header header = {{'R', 'T', 'T', 'X'}, std::uint32_t(image.width), std::uint32_t(image.height),
+                                  std::uint32_t(tile_size), std::uint32_t(levels)};
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+    std::vector<unsigned char> tile(3 * tile_size * tile_size);
+    static const interval intensity(0.000, 0.999);
+
+    for (int level = 0; level < levels; level++)
+    {
+        int w = mip_size(image.width, level);
+        int h = mip_size(image.height, level);
+
+        if (level > 0)
+        {
+            // box filter the previous level down, each texel averages the up to 2x2 texels above it
+            int pw = mip_size(image.width, level - 1);
+            int ph = mip_size(image.height, level - 1);
+            std::vector<color> next(w * h);
+            for (int y = 0; y < h; y++)
+                for (int x = 0; x < w; x++)
+                {
+                    color sum(0, 0, 0);
+                    int count = 0;
+                    for (int dy = 0; dy < 2; dy++)
+                        for (int dx = 0; dx < 2; dx++)
+                        {
+                            int sx = std::min(2 * x + dx, pw - 1);
+                            int sy = std::min(2 * y + dy, ph - 1);
+                            sum += level_pixels[sy * pw + sx];
+                            count++;
+                        }
+                    next[y * w + x] = sum / count;
+                }
+            level_pixels.swap(next);
+        }
+
+        for (int ty = 0; ty < tiles_across(h, tile_size); ty++)
+            for (int tx = 0; tx < tiles_across(w, tile_size); tx++)
+            {
+                for (int y = 0; y < tile_size; y++)
+                    for (int x = 0; x < tile_size; x++)
+                    {
+                        // past the edge we repeat the last texel so filtering near the border stays sane
+                        int sx = std::min(tx * tile_size + x, w - 1);
+                        int sy = std::min(ty * tile_size + y, h - 1);
+                        const color &c = level_pixels[sy * w + sx];
+                        unsigned char *dst = &tile[3 * (y * tile_size + x)];
+                        dst[0] = (unsigned char)(256 * intensity.clamp(linear_to_gamma(c.x())));
+                        dst[1] = (unsigned char)(256 * intensity.clamp(linear_to_gamma(c.y())));
+                        dst[2] = (unsigned char)(256 * intensity.clamp(linear_to_gamma(c.z())));
+                    }
+                out.write(reinterpret_cast<const char *>(tile.data()), tile.size());
+            }
+    }
+
+    return bool(out);
+}
+
+class texture_cache
+{
+public:
+    // one tile worth of texels, shared so a tile can be evicted while another thread is still reading it
+    using tile_ptr = shared_ptr<const std::vector<unsigned char>>;
+
+    // budget_bytes is the most tile memory the cache holds at once, split evenly between shards
+    // more shards = less chance two threads want the same lock at the same time
+    texture_cache(size_t budget_bytes, int shard_count = 64) : budget_bytes(budget_bytes), shards(shard_count) {}
+
+    ~texture_cache()
+    {
+        for (const auto &file : files)
+            ::close(file.fd);
+    }
+
+    texture_cache(const texture_cache &) = delete;
+    texture_cache &operator=(const texture_cache &) = delete;
+
+    // register a tiled texture file, returns a handle for lookups or -1 if the file can't be read
+    // open every texture while loading the scene, before any render threads start
+    // the file stays open until the cache goes away, every tile is read from it with pread, which doesn't move a
+    // shared file position, so any number of threads can load tiles at once without opening the file again
+    int open(const std::string &path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return -1;
+        texture_file_header header;
+        if (::pread(fd, &header, sizeof(header), 0) != ssize_t(sizeof(header)) || std::memcmp(header.magic, "RTTX", 4) != 0)
+        {
+            ::close(fd);
+            return -1;
+        }
+
+        texture_file file;
+        file.fd = fd;
+        file.width = header.width;
+        file.height = header.height;
+        file.tile_size = header.tile_size;
+
+        // byte offset of each level's first tile, so any tile can be found without reading the others
+        std::streamoff offset = sizeof(header);
+        for (std::uint32_t level = 0; level < header.levels; level++)
+        {
+            file.level_offsets.push_back(offset);
+            int w = mip_size(file.width, level);
+            int h = mip_size(file.height, level);
+            offset += std::streamoff(tiles_across(w, file.tile_size)) * tiles_across(h, file.tile_size) * file.tile_bytes();
+        }
+
+        files.push_back(file);
+        return int(files.size()) - 1;
+    }
+
+    int width(int handle) const { return files[handle].width; }
+    int height(int handle) const { return files[handle].height; }
+    int levels(int handle) const { return int(files[handle].level_offsets.size()); }
+
+    // linear color of texel x,y of a mip level, coordinates get clamped to the level
+    color texel(int handle, int level, int x, int y)
+    {
+        const texture_file &file = files[handle];
+        level = std::max(0, std::min(level, levels(handle) - 1));
+        x = std::max(0, std::min(x, mip_size(file.width, level) - 1));
+        y = std::max(0, std::min(y, mip_size(file.height, level) - 1));
+
+        int ts = file.tile_size;
+        tile_ptr tile = get_tile(handle, level, x / ts, y / ts);
+        return tile_texel(*tile, ts, x % ts, y % ts);
+    }
+
+    // bilinear lookup at a mip level, u,v in [0,1] with v = 1 at the top of the image
+    color sample(int handle, double u, double v, int level)
+    {
+        const texture_file &file = files[handle];
+        level = std::max(0, std::min(level, levels(handle) - 1));
+        int w = mip_size(file.width, level);
+        int h = mip_size(file.height, level);
+
+        static const interval unit(0, 1);
+        auto x = unit.clamp(u) * w - 0.5;
+        auto y = (1 - unit.clamp(v)) * h - 0.5;
+        int x0 = int(std::floor(x));
+        int y0 = int(std::floor(y));
+        auto fx = x - x0;
+        auto fy = y - y0;
+
+        // the 4 texels clamped to the level the same way texel() does it
+        int xa = std::max(0, std::min(x0, w - 1));
+        int xb = std::max(0, std::min(x0 + 1, w - 1));
+        int ya = std::max(0, std::min(y0, h - 1));
+        int yb = std::max(0, std::min(y0 + 1, h - 1));
+
+        // almost always all 4 are in one tile, then one cache lookup does for all of them
+        int ts = file.tile_size;
+        if (xa / ts == xb / ts && ya / ts == yb / ts)
+        {
+            tile_ptr tile = get_tile(handle, level, xa / ts, ya / ts);
+            xa %= ts, xb %= ts, ya %= ts, yb %= ts;
+            return (1 - fy) * ((1 - fx) * tile_texel(*tile, ts, xa, ya) + fx * tile_texel(*tile, ts, xb, ya)) +
+                   fy * ((1 - fx) * tile_texel(*tile, ts, xa, yb) + fx * tile_texel(*tile, ts, xb, yb));
+        }
+
+        // on a tile edge each texel goes through the cache on its own
+        return (1 - fy) * ((1 - fx) * texel(handle, level, x0, y0) + fx * texel(handle, level, x0 + 1, y0)) +
+               fy * ((1 - fx) * texel(handle, level, x0, y0 + 1) + fx * texel(handle, level, x0 + 1, y0 + 1));
+    }
+
+    // how many tiles were read from disk so far, handy for checking the budget is big enough
+    size_t tile_loads() const
+    {
+        size_t total = 0;
+        for (const auto &shard : shards)
+            total += shard.loads;
+        return total;
+    }
+
+    // tile memory held right now, over all shards
+    size_t resident_bytes()
+    {
+        size_t total = 0;
+        for (auto &shard : shards)
+        {
+            std::lock_guard<std::mutex> guard(shard.lock);
+            total += shard.bytes;
+        }
+        return total;
+    }
+
+private:
+    struct texture_file
+    {
+        int fd;
+        int width;
+        int height;
+        int tile_size;
+        std::vector<std::streamoff> level_offsets;
+
+        size_t tile_bytes() const { return 3 * size_t(tile_size) * tile_size; }
+    };
+
+    // each shard is its own little LRU cache with its own lock
+    // a tile always hashes to the same shard, so threads only wait on each other when they hit the same shard
+    struct shard
+    {
+        std::mutex lock;
+        std::list<std::pair<std::uint64_t, tile_ptr>> lru; // most recently used at the front
+        std::unordered_map<std::uint64_t, std::list<std::pair<std::uint64_t, tile_ptr>>::iterator> index;
+        size_t bytes = 0;
+        size_t loads = 0;
+    };
+
+    size_t budget_bytes;
+    std::vector<shard> shards;
+    std::vector<texture_file> files;
+
+    // linear color of texel x,y within a tile
+    static color tile_texel(const std::vector<unsigned char> &tile, int tile_size, int x, int y)
+    {
+        const unsigned char *t = &tile[3 * (y * tile_size + x)];
+
+        // stored gamma encoded like our output images, squaring undoes our sqrt gamma
+        color c = (1.0 / 255.0) * color(t[0], t[1], t[2]);
+        return c * c;
+    }
+
+    // file, level and tile position packed into one number so it can be a hash map key
+    static std::uint64_t tile_key(int handle, int level, int tx, int ty)
+    {
+        return (std::uint64_t(handle) << 48) | (std::uint64_t(level) << 40) | (std::uint64_t(ty) << 20) | std::uint64_t(tx);
+    }
+
+    tile_ptr get_tile(int handle, int level, int tx, int ty)
+    {
+        auto key = tile_key(handle, level, tx, ty);
+        // mix the bits so neighboring tiles spread across shards
+        auto hash = key * 0x9E3779B97F4A7C15ull;
+        shard &s = shards[(hash >> 32) % shards.size()];
+
+        {
+            std::lock_guard<std::mutex> guard(s.lock);
+            auto found = s.index.find(key);
+            if (found != s.index.end())
+            {
+                // move to the front, it's the most recently used now
+                s.lru.splice(s.lru.begin(), s.lru, found->second);
+                return found->second->second;
+            }
+        }
+
+        // read outside the lock so other threads using this shard don't wait on the disk
+        tile_ptr tile = load_tile(handle, level, tx, ty);
+
+        std::lock_guard<std::mutex> guard(s.lock);
+        auto found = s.index.find(key);
+        if (found != s.index.end())
+            return found->second->second; // another thread loaded it while we were reading
+
+        s.lru.emplace_front(key, tile);
+        s.index[key] = s.lru.begin();
+        s.bytes += tile->size();
+        s.loads++;
+
+        // evict from the back until we're under this shard's share of the budget, but always keep the tile we just loaded
+        size_t shard_budget = budget_bytes / shards.size();
+        while (s.bytes > shard_budget && s.lru.size() > 1)
+        {
+            s.bytes -= s.lru.back().second->size();
+            s.index.erase(s.lru.back().first);
+            s.lru.pop_back();
+        }
+
+        return tile;
+    }
+
+    tile_ptr load_tile(int handle, int level, int tx, int ty) const
+    {
+        const texture_file &file = files[handle];
+        int w = mip_size(file.width, level);
+        std::streamoff tile_index = std::streamoff(ty) * tiles_across(w, file.tile_size) + tx;
+
+        auto tile = make_shared<std::vector<unsigned char>>(file.tile_bytes());
+        off_t offset = off_t(file.level_offsets[level] + tile_index * std::streamoff(file.tile_bytes()));
+        if (::pread(file.fd, tile->data(), tile->size(), offset) != ssize_t(tile->size()))
+            std::fill(tile->begin(), tile->end(), 0); // unreadable tile shows up black instead of crashing the render
+        return tile;
+    }
+};
+
+#endif
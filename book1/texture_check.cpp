@@ -0,0 +1,147 @@
+#include "rtweekend.h"
+
+#include "texture_cache.h"
+
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <thread>
+
+// checks the texture cache against the image it was made from
+// converts a generated pattern to the tiled format, reads every texel of every mip level back through a cache
+// that has room for everything, checks bilinear samples blend exactly those texels, then hammers a cache with a tiny budget from several threads at once:
+// it has to keep evicting, stay near its budget and still return exactly the same texels
+// build with: g++ -std=c++14 -O2 -pthread texture_check.cpp -o texture_check
+// usage: ./texture_check [scratch file]
+
+// texels go through the same byte to color math every time, so equal means exactly equal
+static bool same(const color &a, const color &b)
+{
+    return a.x() == b.x() && a.y() == b.y() && a.z() == b.z();
+}
+
+int main(int argc, char *argv[])
+{
+    std::string ppm_path = argc > 1 ? argv[1] : "/tmp/texture_check.ppm";
+    std::string tiled_path = ppm_path + ".rttx";
+    const int tile_size = 32;
+
+    // not a power of two and not a multiple of the tile size, so the edge tiles and odd mip sizes get covered
+    ppm_image image = checker_pattern(300, 170);
+    if (!image.save(ppm_path) || !write_tiled_texture(ppm_path, tiled_path, tile_size))
+    {
+        std::cerr << "can't write " << tiled_path << std::endl;
+        return 2;
+    }
+
+    // the image as it was quantized to bytes on the way to disk
+    ppm_image stored;
+    stored.load(ppm_path);
+
+    int failures = 0;
+
+    // everything fits, so this cache never evicts and every tile is read once
+    texture_cache roomy(size_t(1) << 30);
+    int handle = roomy.open(tiled_path);
+    if (handle < 0)
+    {
+        std::cerr << "can't open " << tiled_path << std::endl;
+        return 2;
+    }
+
+    // level 0 has to come back exactly as the image was, the stored bytes are the image's bytes
+    for (int y = 0; y < image.height; y++)
+        for (int x = 0; x < image.width; x++)
+        {
+            color expected = stored.pixels[size_t(y) * image.width + x];
+            if (!same(roomy.texel(handle, 0, x, y), expected * expected))
+                failures++;
+        }
+    std::cout << "level 0: " << (failures == 0 ? "matches the image" : "differs from the image") << std::endl;
+
+    // every texel of every level, what the small cache must agree with
+    struct lookup
+    {
+        int level, x, y;
+        color value;
+    };
+    std::vector<lookup> lookups;
+    int tile_count = 0;
+    for (int level = 0; level < roomy.levels(handle); level++)
+    {
+        int w = mip_size(image.width, level);
+        int h = mip_size(image.height, level);
+        tile_count += tiles_across(w, tile_size) * tiles_across(h, tile_size);
+        for (int y = 0; y < h; y++)
+            for (int x = 0; x < w; x++)
+                lookups.push_back({level, x, y, roomy.texel(handle, level, x, y)});
+    }
+    std::cout << roomy.levels(handle) << " levels, " << tile_count << " tiles, " << roomy.tile_loads() << " loaded" << std::endl;
+    if (int(roomy.tile_loads()) != tile_count)
+        failures++;
+
+    // bilinear samples take all 4 texels from one tile lookup when they can, they have to blend exactly
+    // the texels texel() returns, inside tiles, across tile edges and clamped at the image border
+    int sample_mismatches = 0;
+    for (int level = 0; level < roomy.levels(handle); level++)
+    {
+        int w = mip_size(image.width, level);
+        int h = mip_size(image.height, level);
+        for (int j = 0; j <= 4 * h; j++)
+            for (int i = 0; i <= 4 * w; i++)
+            {
+                double u = double(i) / (4 * w);
+                double v = double(j) / (4 * h);
+                auto x = u * w - 0.5;
+                auto y = (1 - v) * h - 0.5;
+                int x0 = int(std::floor(x));
+                int y0 = int(std::floor(y));
+                auto fx = x - x0;
+                auto fy = y - y0;
+                color expected = (1 - fy) * ((1 - fx) * roomy.texel(handle, level, x0, y0) + fx * roomy.texel(handle, level, x0 + 1, y0)) +
+                                 fy * ((1 - fx) * roomy.texel(handle, level, x0, y0 + 1) + fx * roomy.texel(handle, level, x0 + 1, y0 + 1));
+                if (!same(roomy.sample(handle, u, v, level), expected))
+                    sample_mismatches++;
+            }
+    }
+    std::cout << "bilinear samples: " << sample_mismatches << " mismatches" << std::endl;
+    failures += sample_mismatches;
+
+    // room for 4 tiles in 4 shards, so each shard holds one tile and almost every lookup below is a miss
+    const size_t tile_bytes = 3 * tile_size * tile_size;
+    const int shard_count = 4;
+    texture_cache tiny(4 * tile_bytes, shard_count);
+    tiny.open(tiled_path);
+
+    // each thread walks all lookups from its own starting point, so they fight over the same shards in different orders
+    const int threads = 8;
+    std::atomic<int> mismatches(0);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++)
+        workers.emplace_back([&, t]()
+                             {
+                                 size_t start = lookups.size() * t / threads;
+                                 for (size_t k = 0; k < lookups.size(); k++)
+                                 {
+                                     const lookup &l = lookups[(start + k) % lookups.size()];
+                                     if (!same(tiny.texel(handle, l.level, l.x, l.y), l.value))
+                                         mismatches++;
+                                 }
+                             });
+    for (auto &w : workers)
+        w.join();
+
+    // a shard always keeps the tile it just loaded, so it can sit one tile over its share
+    size_t resident_limit = 4 * tile_bytes + shard_count * tile_bytes;
+    std::cout << "small budget: " << mismatches << " mismatches, " << tiny.tile_loads() << " tile loads, "
+              << tiny.resident_bytes() << " of " << resident_limit << " bytes resident" << std::endl;
+    failures += mismatches;
+    if (int(tiny.tile_loads()) <= tile_count || tiny.resident_bytes() > resident_limit)
+        failures++;
+
+    std::remove(ppm_path.c_str());
+    std::remove(tiled_path.c_str());
+
+    std::cout << (failures == 0 ? "PASS" : "FAIL") << std::endl;
+    return failures == 0 ? 0 : 1;
+}
@@ -162,6 +162,17 @@ inline vec3 random_unit_vector()
     }
 }
 
+// random point inside the unit disk on the xy plane, for sampling the camera lens
+inline vec3 random_in_unit_disk()
+{
+    while (true)
+    {
+        auto p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
+        if (p.length_squared() < 1)
+            return p;
+    }
+}
+
 // dot product of the surface normal and the random vector for hemisphere detection
 // if the dot product is positive the vector is correct, if not we need to invert it
 // we only want diffuse reflection on outside surfaces
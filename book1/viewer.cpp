@@ -0,0 +1,82 @@
+#include "rtweekend.h"
+
+#include "preview.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <thread>
+
+// a minimal viewer for ./main --preview
+// connects to the preview socket, forwards camera commands typed on stdin, and writes every frame it gets to a ppm
+// any image viewer that reloads on change can show the file live
+// build with: g++ -std=c++14 -O2 -pthread viewer.cpp -o viewer
+// usage: ./viewer [socket_path] [output.ppm]
+
+using viewer_clock = std::chrono::steady_clock;
+
+// when we last asked for a new view, frames report how long they took to show up after that
+std::atomic<viewer_clock::rep> last_request(0);
+
+int main(int argc, char *argv[])
+{
+    std::string socket_path = argc > 1 ? argv[1] : "/tmp/raytracer.sock";
+    std::string output_path = argc > 2 ? argv[2] : "preview.ppm";
+
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+    if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0)
+    {
+        std::cerr << "can't connect to " << socket_path << ", is ./main --preview running?" << std::endl;
+        return 1;
+    }
+    // the server starts rendering as soon as we connect, so connecting counts as the first request
+    last_request = viewer_clock::now().time_since_epoch().count();
+
+    // stdin lines go straight to the server, it understands lookfrom/lookat/vfov/defocus/quit
+    std::thread input([fd]()
+                      {
+                          std::string line;
+                          while (std::getline(std::cin, line))
+                          {
+                              line += '\n';
+                              last_request = viewer_clock::now().time_since_epoch().count();
+                              if (!send_all(fd, line.data(), line.size()))
+                                  break;
+                          }
+                      });
+    input.detach();
+
+    preview_frame_header header;
+    std::vector<char> pixels;
+    while (receive_all(fd, &header, sizeof(header)))
+    {
+        pixels.resize(3 * size_t(header.width) * header.height);
+        if (!receive_all(fd, pixels.data(), pixels.size()))
+            break;
+
+        auto since_request = viewer_clock::now() - viewer_clock::time_point(viewer_clock::duration(last_request.load()));
+        std::cout << "view " << header.view << " pass " << header.pass << (header.last_pass ? " (final) " : " ")
+                  << header.width << 'x' << header.height
+                  << ", rendered in " << header.render_ms << " ms"
+                  << ", " << std::chrono::duration<double, std::milli>(since_request).count() << " ms after the request"
+                  << std::endl;
+
+        // write next to the output and rename over it, so whatever is watching the file never sees half a frame
+        std::string temp_path = output_path + ".tmp";
+        {
+            std::ofstream out(temp_path, std::ios::binary);
+            out << "P6\n"
+                << header.width << ' ' << header.height << "\n255\n";
+            out.write(pixels.data(), pixels.size());
+        }
+        std::rename(temp_path.c_str(), output_path.c_str());
+    }
+
+    ::close(fd);
+}